@@ -31,6 +31,15 @@
 #include "tablebase.h"
 
 static int	compare_analysis(const void*, const void*);
+static tb_entry	wdl_search(const struct tablebase*, const struct position*, unsigned);
+
+enum {
+	/*
+	 * How many half moves wdl_search() looks ahead of each move when
+	 * the tablebase has no distance to mate information.
+	 */
+	WDL_SEARCH_DEPTH = 2,
+};
 
 /*
  * Generate a random seed for use with ai_move().  Currently, the
@@ -70,23 +79,46 @@ extern size_t
 analyze_position(struct analysis an[MAX_MOVES],
     const struct tablebase *tb, const struct position *p, double strength)
 {
-	struct position pp;
-	struct move moves[MAX_MOVES];
+	struct position pps[MAX_MOVES];
+	struct move moves[MAX_MOVES], legal[MAX_MOVES];
+	tb_entry entries[MAX_MOVES];
 	double total = 0.0;
-	size_t i, nmove;
+	size_t i, j = 0, nmove, nlegal, npp = 0, index[MAX_MOVES];
 
+	/* legal is a subsequence of moves */
 	nmove = generate_moves(moves, p);
+	nlegal = generate_legal_moves(legal, p);
 	for (i = 0; i < nmove; i++) {
-		pp = *p;
 		an[i].move = moves[i];
-		if (play_move(&pp, moves + i))
+
+		/* moves into check lose at once, don't look them up */
+		if (j == nlegal || moves[i].piece != legal[j].piece || moves[i].to != legal[j].to) {
+			an[i].entry = prev_dtm(1);
+			continue;
+		}
+
+		j++;
+		pps[npp] = *p;
+		if (play_move(pps + npp, moves + i))
 			an[i].entry = 1;
 		else
-			an[i].entry = prev_dtm(lookup_position(tb, &pp));
+			index[npp++] = i;
+	}
+
+	/* look up all positions where the game goes on at once */
+	lookup_positions(tb, pps, npp, entries);
+	for (i = 0; i < npp; i++) {
+		if (!has_dtm(entries[i]))
+			entries[i] = wdl_search(tb, pps + i, WDL_SEARCH_DEPTH);
+
+		an[index[i]].entry = prev_dtm(entries[i]);
+		if (an[index[i]].entry > WDL_DISTANCE)
+			an[index[i]].entry = WDL_DISTANCE;
+	}
 
+	for (i = 0; i < nmove; i++)
 		total += an[i].value = an[i].entry == 0.0 ?
 		    1.0 : exp(strength / an[i].entry);
-	}
 
 	assert(nmove == 0 || total > 0);
 
@@ -99,6 +131,43 @@ analyze_position(struct analysis an[MAX_MOVES],
 	return (nmove);
 }
 
+/*
+ * If tb only has WDL information, wins and losses all look the same
+ * and the engine might never make progress towards winning.  To
+ * mitigate this, search depth half moves ahead of p for the quickest
+ * win or slowest loss.  Return the value of p with the distance to mate
+ * if one was found within the search horizon.
+ */
+static tb_entry
+wdl_search(const struct tablebase *tb, const struct position *p, unsigned depth)
+{
+	struct position pp;
+	struct move moves[MAX_MOVES];
+	size_t i, nmove;
+	tb_entry e, best = -1;
+
+	e = lookup_position(tb, p);
+	if (has_dtm(e) || depth == 0)
+		return (e);
+
+	/* moves into check are no better than best's initial value */
+	nmove = generate_legal_moves(moves, p);
+	for (i = 0; i < nmove; i++) {
+		pp = *p;
+		if (play_move(&pp, moves + i))
+			return (1);
+
+		e = prev_dtm(wdl_search(tb, &pp, depth - 1));
+		if (e > WDL_DISTANCE)
+			e = WDL_DISTANCE;
+
+		if (wdl_compare(e, best) > 0)
+			best = e;
+	}
+
+	return (best);
+}
+
 /*
  * Using the seed s, generate an ai move for position p, looking up
  * position evaluations from tb.  strength indicates the AI strength,
@@ -32,7 +32,16 @@
  *
  * These macros define the following macros and types:
  *  atomic_schar -- an atomic signed char type
+ *  atomic_uchar -- an atomic unsigned char type
+ *  atomic_ulong -- an atomic unsigned long type
+ *  atomic_ullong -- an atomic unsigned long long type
+ *  atomic_load() -- a C11 like atomic load macro
  *  atomic_exchange() -- a C11 like atomic exchange macro
+ *  atomic_fetch_add() -- a C11 like atomic fetch-and-add macro
+ *  atomic_fetch_sub() -- a C11 like atomic fetch-and-subtract macro
+ *  atomic_fetch_or() -- a C11 like atomic fetch-and-or macro
+ *  atomic_compare_exchange_strong() -- a C11 like compare-and-swap
+ *    macro, only available for atomic_ullong outside of C11.
  */
 
 /* clang uses this */
@@ -49,12 +58,35 @@ _Static_assert(sizeof (atomic_schar) == 1,
     || defined(__GNUC__) && __GNUC__ >= 4
 /* gcc __sync functions */
 typedef volatile signed char atomic_schar;
+typedef volatile unsigned char atomic_uchar;
+typedef volatile unsigned long atomic_ulong;
+typedef volatile unsigned long long atomic_ullong;
+# define atomic_load(x) __sync_fetch_and_add((x), 0)
 # define atomic_exchange __sync_lock_test_and_set
+# define atomic_fetch_add __sync_fetch_and_add
+# define atomic_fetch_sub __sync_fetch_and_sub
+# define atomic_fetch_or __sync_fetch_and_or
+
+static inline int
+atomic_compare_exchange_strong(atomic_ullong *x, unsigned long long *expected,
+    unsigned long long desired)
+{
+	unsigned long long old = __sync_val_compare_and_swap(x, *expected, desired);
+
+	if (old == *expected)
+		return (1);
+
+	*expected = old;
+	return (0);
+}
 #else
 /* no atomic primitives */
 #define NO_ATOMICS
 typedef signed char atomic_schar;
-
+typedef unsigned char atomic_uchar;
+typedef unsigned long atomic_ulong;
+typedef unsigned long long atomic_ullong;
+#define atomic_load(x) (*(x))
 
 static inline
 atomic_schar atomic_exchange(atomic_schar *x, atomic_schar c)
@@ -64,6 +96,46 @@ atomic_schar atomic_exchange(atomic_schar *x, atomic_schar c)
 	*x = c;
 	return (old);
 }
+
+static inline
+unsigned char atomic_fetch_add(atomic_uchar *x, unsigned char v)
+{
+	unsigned char old = *x;
+
+	*x += v;
+	return (old);
+}
+
+static inline
+unsigned char atomic_fetch_sub(atomic_uchar *x, unsigned char v)
+{
+	unsigned char old = *x;
+
+	*x -= v;
+	return (old);
+}
+
+static inline
+unsigned long atomic_fetch_or(atomic_ulong *x, unsigned long v)
+{
+	unsigned long old = *x;
+
+	*x |= v;
+	return (old);
+}
+
+static inline int
+atomic_compare_exchange_strong(atomic_ullong *x, unsigned long long *expected,
+    unsigned long long desired)
+{
+	if (*x != *expected) {
+		*expected = *x;
+		return (0);
+	}
+
+	*x = desired;
+	return (1);
+}
 #endif
 
 #endif /* ATOMICS_H */
@@ -0,0 +1,1006 @@
+/*-
+ * Copyright (c) 2016--2017 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _XOPEN_SOURCE 700L /* for nrand48() */
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dobutsutable.h"
+#include "version.h"
+
+/*
+ * This program times the core operations of the tablebase generator
+ * and the engine in isolation and prints the results in a machine
+ * readable format (JSON or CSV) so results from different revisions
+ * can be compared.  Each benchmark is run a number of times (samples)
+ * and for each sample, the time per operation is recorded.  Minimum,
+ * median, mean, and standard deviation of these times are reported in
+ * nanoseconds.
+ *
+ * The micro benchmarks operate on a fixed set of pseudo-random
+ * positions taken from the tablebase encoding space, so results are
+ * reproducible between runs.
+ */
+
+enum {
+	/* number of positions the micro benchmarks work on */
+	BENCH_POSITIONS = 16384,
+
+	/* default number of samples for cheap and for costly benchmarks */
+	MICRO_SAMPLES = 20,
+	LOAD_SAMPLES = 3,
+	GENTB_SAMPLES = 1,
+
+	/* default number of rounds for the reduced gentb run */
+	GENTB_ROUNDS = 2,
+
+	/* flags for struct benchmark */
+	NEED_TB = 1 << 0,	/* needs a tablebase */
+	NEED_RAW = 1 << 1,	/* needs an uncompressed tablebase file */
+	NEED_XZ = 1 << 2,	/* needs an xz compressed tablebase file */
+	NO_WARMUP = 1 << 3,	/* too costly for a warmup run */
+};
+
+/*
+ * Inputs for the benchmarks.  positions and codes contain the same
+ * npos positions, codes in encoded form.  sweep is the first of
+ * nsweep consecutive poscodes, as visited by full-table sweeps.  moves
+ * and unmoves contain all moves and unmoves possible from these
+ * positions, each with the number of the position they apply to and
+ * whether the resulting position can be encoded, i.e. the game doesn't
+ * end and the side not to move isn't in check.  entries has room for
+ * the values of all positions.
+ */
+struct bench_ctx {
+	struct position *positions;
+	poscode *codes;
+	size_t npos;
+
+	poscode sweep;
+	size_t nsweep;
+
+	struct bench_move {
+		size_t pos;
+		struct move move;
+		int encodable;
+	} *moves;
+	size_t nmove;
+
+	struct bench_unmove {
+		size_t pos;
+		struct unmove unmove;
+		int encodable;
+	} *unmoves;
+	size_t nunmove;
+
+	const char *rawfile, *xzfile;
+	int tbflags;
+	struct tablebase *tb;
+	tb_entry *entries;
+	struct gentb_options gentb;
+};
+
+/*
+ * A benchmark.  run() executes one sample of the benchmark and returns
+ * the number of operations performed.  samples is the default number
+ * of samples taken, flags a combination of the flags above.
+ */
+struct benchmark {
+	const char *name;
+	size_t (*run)(struct bench_ctx *);
+	unsigned samples;
+	int flags;
+};
+
+/* results of a benchmark */
+struct bench_result {
+	const char *name;
+	unsigned samples;
+	size_t ops;
+	double min, median, mean, stddev;
+};
+
+/* results accumulate here to keep the compiler from optimizing them away */
+static volatile unsigned long long sink;
+
+static size_t	bench_encode_position(struct bench_ctx *);
+static size_t	bench_decode_poscode(struct bench_ctx *);
+static size_t	bench_decode_sweep(struct bench_ctx *);
+static size_t	bench_next_poscode(struct bench_ctx *);
+static size_t	bench_generate_moves(struct bench_ctx *);
+static size_t	bench_generate_legal_moves(struct bench_ctx *);
+static size_t	bench_generate_unmoves(struct bench_ctx *);
+static size_t	bench_play_move(struct bench_ctx *);
+static size_t	bench_undo_move(struct bench_ctx *);
+static size_t	bench_play_check(struct bench_ctx *);
+static size_t	bench_xplay_check(struct bench_ctx *);
+static size_t	bench_move_into_check(struct bench_ctx *);
+static size_t	bench_play_encode(struct bench_ctx *);
+static size_t	bench_encode_move(struct bench_ctx *);
+static size_t	bench_undo_encode(struct bench_ctx *);
+static size_t	bench_encode_unmove(struct bench_ctx *);
+static size_t	bench_lookup_position(struct bench_ctx *);
+static size_t	bench_lookup_positions(struct bench_ctx *);
+static size_t	bench_analyze_position(struct bench_ctx *);
+static size_t	bench_load_raw(struct bench_ctx *);
+static size_t	bench_load_xz(struct bench_ctx *);
+static size_t	bench_gentb(struct bench_ctx *);
+static size_t	bench_gentb_forward(struct bench_ctx *);
+static size_t	bench_gentb_counter(struct bench_ctx *);
+static size_t	bench_gentb_local(struct bench_ctx *);
+static size_t	bench_gentb_interleave(struct bench_ctx *);
+
+static const struct benchmark benchmarks[] = {
+	{ "encode_position", bench_encode_position, MICRO_SAMPLES, 0 },
+	{ "decode_poscode", bench_decode_poscode, MICRO_SAMPLES, 0 },
+	{ "decode_sweep", bench_decode_sweep, MICRO_SAMPLES, 0 },
+	{ "next_poscode", bench_next_poscode, MICRO_SAMPLES, 0 },
+	{ "generate_moves", bench_generate_moves, MICRO_SAMPLES, 0 },
+	{ "generate_legal_moves", bench_generate_legal_moves, MICRO_SAMPLES, 0 },
+	{ "generate_unmoves", bench_generate_unmoves, MICRO_SAMPLES, 0 },
+	{ "play_move", bench_play_move, MICRO_SAMPLES, 0 },
+	{ "undo_move", bench_undo_move, MICRO_SAMPLES, 0 },
+	{ "play_check", bench_play_check, MICRO_SAMPLES, 0 },
+	{ "xplay_check", bench_xplay_check, MICRO_SAMPLES, 0 },
+	{ "move_into_check", bench_move_into_check, MICRO_SAMPLES, 0 },
+	{ "play_encode", bench_play_encode, MICRO_SAMPLES, 0 },
+	{ "encode_move", bench_encode_move, MICRO_SAMPLES, 0 },
+	{ "undo_encode", bench_undo_encode, MICRO_SAMPLES, 0 },
+	{ "encode_unmove", bench_encode_unmove, MICRO_SAMPLES, 0 },
+	{ "lookup_position", bench_lookup_position, MICRO_SAMPLES, NEED_TB },
+	{ "lookup_positions", bench_lookup_positions, MICRO_SAMPLES, NEED_TB },
+	{ "analyze_position", bench_analyze_position, MICRO_SAMPLES, NEED_TB },
+	{ "load_raw", bench_load_raw, LOAD_SAMPLES, NEED_RAW | NO_WARMUP },
+	{ "load_xz", bench_load_xz, LOAD_SAMPLES, NEED_XZ | NO_WARMUP },
+	{ "gentb", bench_gentb, GENTB_SAMPLES, NO_WARMUP },
+	{ "gentb_forward", bench_gentb_forward, GENTB_SAMPLES, NO_WARMUP },
+	{ "gentb_counter", bench_gentb_counter, GENTB_SAMPLES, NO_WARMUP },
+	{ "gentb_local", bench_gentb_local, GENTB_SAMPLES, NO_WARMUP },
+	{ "gentb_interleave", bench_gentb_interleave, GENTB_SAMPLES, NO_WARMUP },
+};
+
+enum { BENCHMARK_COUNT = sizeof benchmarks / sizeof benchmarks[0] };
+
+static void	make_inputs(struct bench_ctx *);
+static struct tablebase *load_tablebase(const char *, int);
+static void	run_benchmark(struct bench_result *, const struct benchmark *,
+		    struct bench_ctx *, unsigned);
+static int	compare_double(const void *, const void *);
+static void	print_json(const struct bench_result *, size_t, const char *);
+static void	print_csv(const struct bench_result *, size_t);
+
+static void
+usage(const char *argv0)
+{
+	size_t i;
+
+	fprintf(stderr, "Usage: %s [-H] [-f json|csv] [-j nproc] [-n samples] [-r rounds] "
+	    "[-t tbfile] [-x tbfile.xz] [benchmark ...]\n", argv0);
+	fprintf(stderr, "Benchmarks:");
+	for (i = 0; i < BENCHMARK_COUNT; i++)
+		fprintf(stderr, " %s", benchmarks[i].name);
+
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Run the benchmarks given on the command line or all benchmarks if
+ * none are given.  Benchmarks needing a tablebase are skipped if no
+ * tablebase is provided with -t (uncompressed) or -x (xz compressed).
+ * The number of samples can be overridden with -n.  The reduced gentb
+ * run consists of -r rounds (default 2) with -j threads (default 1).
+ * With -H, tablebases are backed by huge pages if possible.  Comparing
+ * runs with and without -H shows the effect of TLB misses.  Likewise,
+ * comparing gentb with gentb_local and gentb_interleave shows the
+ * effect of NUMA placement.
+ */
+extern int
+main(int argc, char *argv[])
+{
+	struct bench_ctx ctx;
+	struct bench_result results[BENCHMARK_COUNT];
+	size_t i, nresult = 0;
+	long samples = 0, rounds = GENTB_ROUNDS, threads = 1;
+	int optchar, json = 1, selected[BENCHMARK_COUNT], j;
+	char *endptr;
+
+	memset(&ctx, 0, sizeof ctx);
+
+	while (optchar = getopt(argc, argv, "Hf:j:n:r:t:x:"), optchar != -1)
+		switch (optchar) {
+		case 'H':
+			ctx.tbflags |= TB_HUGEPAGE;
+			break;
+
+		case 'f':
+			if (strcmp(optarg, "json") == 0)
+				json = 1;
+			else if (strcmp(optarg, "csv") == 0)
+				json = 0;
+			else
+				usage(argv[0]);
+
+			break;
+
+		case 'j':
+			threads = strtol(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || threads <= 0 || threads > INT_MAX)
+				usage(argv[0]);
+
+			break;
+
+		case 'n':
+			samples = strtol(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || samples <= 0 || samples > UINT_MAX)
+				usage(argv[0]);
+
+			break;
+
+		case 'r':
+			rounds = strtol(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || rounds <= 0 || rounds > UINT_MAX)
+				usage(argv[0]);
+
+			break;
+
+		case 't':
+			ctx.rawfile = optarg;
+			break;
+
+		case 'x':
+			ctx.xzfile = optarg;
+			break;
+
+		case '?':
+		default:
+			usage(argv[0]);
+		}
+
+	for (i = 0; i < BENCHMARK_COUNT; i++)
+		selected[i] = optind == argc;
+
+	for (j = optind; j < argc; j++) {
+		for (i = 0; i < BENCHMARK_COUNT; i++)
+			if (strcmp(argv[j], benchmarks[i].name) == 0)
+				break;
+
+		if (i == BENCHMARK_COUNT) {
+			fprintf(stderr, "Unknown benchmark %s\n", argv[j]);
+			usage(argv[0]);
+		}
+
+		selected[i] = 1;
+	}
+
+	ctx.gentb.threads = threads;
+	ctx.gentb.flags = ctx.tbflags;
+	ctx.gentb.max_rounds = rounds;
+	make_inputs(&ctx);
+
+	for (i = 0; i < BENCHMARK_COUNT; i++) {
+		if (!selected[i])
+			continue;
+
+		if ((benchmarks[i].flags & NEED_RAW && ctx.rawfile == NULL)
+		    || (benchmarks[i].flags & NEED_XZ && ctx.xzfile == NULL)
+		    || (benchmarks[i].flags & NEED_TB && ctx.rawfile == NULL && ctx.xzfile == NULL)) {
+			fprintf(stderr, "Skipping %s, no suitable tablebase given\n", benchmarks[i].name);
+			continue;
+		}
+
+		if (benchmarks[i].flags & NEED_TB && ctx.tb == NULL) {
+			if (ctx.rawfile != NULL)
+				ctx.tb = load_tablebase(ctx.rawfile, TB_WILLNEED | ctx.tbflags);
+			else
+				ctx.tb = load_tablebase(ctx.xzfile, ctx.tbflags);
+
+			fprintf(stderr, "Tablebase pages: %s\n", tablebase_pages(ctx.tb));
+		}
+
+		fprintf(stderr, "Running %s\n", benchmarks[i].name);
+		run_benchmark(results + nresult++, benchmarks + i, &ctx,
+		    samples != 0 ? samples : benchmarks[i].samples);
+	}
+
+	if (json)
+		print_json(results, nresult, ctx.tb != NULL ? tablebase_pages(ctx.tb) : NULL);
+	else
+		print_csv(results, nresult);
+
+	free_tablebase(ctx.tb);
+
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Fill ctx with pseudo-random positions and the moves and unmoves
+ * possible from them.  Positions are picked from the encoding space
+ * the same way the generator sees them, leaving out positions where
+ * Sente can capture Gote's lion immediately.
+ */
+static void
+make_inputs(struct bench_ctx *ctx)
+{
+	struct move moves[MAX_MOVES];
+	struct unmove unmoves[MAX_UNMOVES];
+	struct position p, pp;
+	poscode pc;
+	size_t i, j, n;
+	unsigned short xsubi[3] = { 0x1234, 0x5678, 0x9abc };
+
+	ctx->npos = BENCH_POSITIONS;
+	ctx->positions = malloc(ctx->npos * sizeof *ctx->positions);
+	ctx->codes = malloc(ctx->npos * sizeof *ctx->codes);
+	ctx->moves = malloc(ctx->npos * MAX_MOVES * sizeof *ctx->moves);
+	ctx->unmoves = malloc(ctx->npos * MAX_UNMOVES * sizeof *ctx->unmoves);
+	ctx->entries = malloc(ctx->npos * sizeof *ctx->entries);
+	if (ctx->positions == NULL || ctx->codes == NULL || ctx->moves == NULL
+	    || ctx->unmoves == NULL || ctx->entries == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	ctx->nmove = 0;
+	ctx->nunmove = 0;
+
+	/* sweep through the start of the largest cohort */
+	pc.ownership = pc.lionpos = pc.map = 0;
+	ctx->sweep = pc;
+	for (pc.cohort = 0; pc.cohort < COHORT_COUNT; pc.cohort++)
+		if (has_valid_ownership(pc)
+		    && cohort_size[pc.cohort].size > cohort_size[ctx->sweep.cohort].size)
+			ctx->sweep.cohort = pc.cohort;
+
+	ctx->nsweep = cohort_size[ctx->sweep.cohort].size * LIONPOS_COUNT;
+	if (ctx->nsweep > ctx->npos)
+		ctx->nsweep = ctx->npos;
+
+	for (i = 0; i < ctx->npos; ) {
+		pc.ownership = nrand48(xsubi) % OWNERSHIP_TOTAL_COUNT;
+		pc.cohort = nrand48(xsubi) % COHORT_COUNT;
+		if (!has_valid_ownership(pc))
+			continue;
+
+		pc.lionpos = nrand48(xsubi) % LIONPOS_COUNT;
+		pc.map = nrand48(xsubi) % cohort_size[pc.cohort].size;
+
+		decode_poscode(&p, pc);
+		if (gote_in_check(&p))
+			continue;
+
+		ctx->positions[i] = p;
+		encode_position(ctx->codes + i, &p);
+
+		n = generate_moves(moves, &p);
+		for (j = 0; j < n; j++) {
+			pp = p;
+			ctx->moves[ctx->nmove].pos = i;
+			ctx->moves[ctx->nmove].move = moves[j];
+			ctx->moves[ctx->nmove++].encodable = !play_move(&pp, moves + j)
+			    && !sente_in_check(&pp);
+		}
+
+		n = generate_unmoves(unmoves, &p);
+		for (j = 0; j < n; j++) {
+			pp = p;
+			undo_move(&pp, unmoves + j);
+			ctx->unmoves[ctx->nunmove].pos = i;
+			ctx->unmoves[ctx->nunmove].unmove = unmoves[j];
+			ctx->unmoves[ctx->nunmove++].encodable = !sente_in_check(&pp);
+		}
+
+		i++;
+	}
+}
+
+/*
+ * Load a tablebase from file name with flags or die trying.
+ */
+static struct tablebase *
+load_tablebase(const char *name, int flags)
+{
+	struct tablebase *tb;
+	FILE *f;
+
+	f = fopen(name, "rb");
+	if (f == NULL) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+
+	tb = read_tablebase(f, flags);
+	if (tb == NULL) {
+		perror("read_tablebase");
+		exit(EXIT_FAILURE);
+	}
+
+	fclose(f);
+
+	return (tb);
+}
+
+/*
+ * Run benchmark b with the given number of samples on ctx and store
+ * statistics in r.  Unless NO_WARMUP is set, the benchmark is run once
+ * before taking samples to warm up caches.
+ */
+static void
+run_benchmark(struct bench_result *r, const struct benchmark *b,
+    struct bench_ctx *ctx, unsigned samples)
+{
+	struct timespec start, end;
+	double *times, sum = 0.0, sqsum = 0.0;
+	unsigned i;
+
+	times = malloc(samples * sizeof *times);
+	if (times == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!(b->flags & NO_WARMUP))
+		b->run(ctx);
+
+	for (i = 0; i < samples; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		r->ops = b->run(ctx);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		times[i] = ((end.tv_sec - start.tv_sec) * 1e9
+		    + (end.tv_nsec - start.tv_nsec)) / r->ops;
+		sum += times[i];
+	}
+
+	qsort(times, samples, sizeof *times, compare_double);
+
+	r->name = b->name;
+	r->samples = samples;
+	r->min = times[0];
+	r->median = samples % 2 ? times[samples / 2]
+	    : (times[samples / 2 - 1] + times[samples / 2]) / 2;
+	r->mean = sum / samples;
+
+	for (i = 0; i < samples; i++)
+		sqsum += (times[i] - r->mean) * (times[i] - r->mean);
+
+	r->stddev = samples > 1 ? sqrt(sqsum / (samples - 1)) : 0.0;
+
+	free(times);
+}
+
+static int
+compare_double(const void *ap, const void *bp)
+{
+	double a = *(const double *)ap, b = *(const double *)bp;
+
+	return ((a > b) - (a < b));
+}
+
+static void
+print_json(const struct bench_result *r, size_t n, const char *pages)
+{
+	size_t i;
+
+	printf("{\n\t\"version\": \"%s\",\n\t\"unit\": \"ns/op\",\n", DOBUTSU_VERSION);
+	if (pages != NULL)
+		printf("\t\"pages\": \"%s\",\n", pages);
+
+	printf("\t\"benchmarks\": [");
+	for (i = 0; i < n; i++)
+		printf("%s\n\t\t{ \"name\": \"%s\", \"samples\": %u, \"ops\": %zu, "
+		    "\"min\": %.1f, \"median\": %.1f, \"mean\": %.1f, \"stddev\": %.1f }",
+		    i > 0 ? "," : "", r[i].name, r[i].samples, r[i].ops,
+		    r[i].min, r[i].median, r[i].mean, r[i].stddev);
+
+	printf("\n\t]\n}\n");
+}
+
+static void
+print_csv(const struct bench_result *r, size_t n)
+{
+	size_t i;
+
+	printf("name,samples,ops,min_ns,median_ns,mean_ns,stddev_ns\n");
+	for (i = 0; i < n; i++)
+		printf("%s,%u,%zu,%.1f,%.1f,%.1f,%.1f\n", r[i].name, r[i].samples,
+		    r[i].ops, r[i].min, r[i].median, r[i].mean, r[i].stddev);
+}
+
+/* the benchmarks themselves */
+
+static size_t
+bench_encode_position(struct bench_ctx *ctx)
+{
+	poscode pc;
+	size_t i;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->npos; i++) {
+		encode_position(&pc, ctx->positions + i);
+		acc += pc.map;
+	}
+
+	sink += acc;
+	return (ctx->npos);
+}
+
+static size_t
+bench_decode_poscode(struct bench_ctx *ctx)
+{
+	struct position p;
+	size_t i;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->npos; i++) {
+		decode_poscode(&p, ctx->codes[i]);
+		acc += p.map;
+	}
+
+	sink += acc;
+	return (ctx->npos);
+}
+
+static size_t
+bench_decode_sweep(struct bench_ctx *ctx)
+{
+	struct position p;
+	poscode pc = ctx->sweep;
+	size_t i;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->nsweep; i++) {
+		pc.lionpos = i / cohort_size[pc.cohort].size;
+		pc.map = i % cohort_size[pc.cohort].size;
+		decode_poscode(&p, pc);
+		acc += p.map;
+	}
+
+	sink += acc;
+	return (ctx->nsweep);
+}
+
+static size_t
+bench_next_poscode(struct bench_ctx *ctx)
+{
+	struct poscode_decoder pd;
+	size_t i;
+	unsigned long long acc = 0;
+
+	start_decoder(&pd, ctx->sweep);
+	for (i = 0; i < ctx->nsweep; i++) {
+		acc += pd.p.map;
+		next_poscode(&pd);
+	}
+
+	sink += acc;
+	return (ctx->nsweep);
+}
+
+static size_t
+bench_generate_moves(struct bench_ctx *ctx)
+{
+	struct move moves[MAX_MOVES];
+	size_t i;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->npos; i++)
+		acc += generate_moves(moves, ctx->positions + i);
+
+	sink += acc;
+	return (ctx->npos);
+}
+
+static size_t
+bench_generate_legal_moves(struct bench_ctx *ctx)
+{
+	struct move moves[MAX_MOVES];
+	size_t i;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->npos; i++)
+		acc += generate_legal_moves(moves, ctx->positions + i);
+
+	sink += acc;
+	return (ctx->npos);
+}
+
+static size_t
+bench_generate_unmoves(struct bench_ctx *ctx)
+{
+	struct unmove unmoves[MAX_UNMOVES];
+	size_t i;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->npos; i++)
+		acc += generate_unmoves(unmoves, ctx->positions + i);
+
+	sink += acc;
+	return (ctx->npos);
+}
+
+static size_t
+bench_play_move(struct bench_ctx *ctx)
+{
+	struct position p;
+	size_t i;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->nmove; i++) {
+		p = ctx->positions[ctx->moves[i].pos];
+		acc += play_move(&p, &ctx->moves[i].move);
+		acc += p.map;
+	}
+
+	sink += acc;
+	return (ctx->nmove);
+}
+
+static size_t
+bench_undo_move(struct bench_ctx *ctx)
+{
+	struct position p;
+	size_t i;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->nunmove; i++) {
+		p = ctx->positions[ctx->unmoves[i].pos];
+		undo_move(&p, &ctx->unmoves[i].unmove);
+		acc += p.map;
+	}
+
+	sink += acc;
+	return (ctx->nunmove);
+}
+
+/*
+ * Find out which moves move into check by playing them, like
+ * normal_round_pos() used to.
+ */
+static size_t
+bench_play_check(struct bench_ctx *ctx)
+{
+	struct position p;
+	size_t i;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->nmove; i++) {
+		p = ctx->positions[ctx->moves[i].pos];
+		play_move(&p, &ctx->moves[i].move);
+		acc += gote_in_check(&p);
+	}
+
+	sink += acc;
+	return (ctx->nmove);
+}
+
+/*
+ * The same with xplay_move() and xgote_in_check(), extending each
+ * position once.
+ */
+static size_t
+bench_xplay_check(struct bench_ctx *ctx)
+{
+	struct xposition xp, xpp;
+	size_t i, pos = (size_t)-1;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->nmove; i++) {
+		if (ctx->moves[i].pos != pos) {
+			pos = ctx->moves[i].pos;
+			extend_position(&xp, ctx->positions + pos);
+		}
+
+		xpp = xp;
+		xplay_move(&xpp, &ctx->moves[i].move);
+		acc += xgote_in_check(&xpp);
+	}
+
+	sink += acc;
+	return (ctx->nmove);
+}
+
+/*
+ * The same with move_into_check(), preparing the check_info once per
+ * position.
+ */
+static size_t
+bench_move_into_check(struct bench_ctx *ctx)
+{
+	struct check_info ci;
+	struct xposition xp;
+	size_t i, pos = (size_t)-1;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->nmove; i++) {
+		if (ctx->moves[i].pos != pos) {
+			pos = ctx->moves[i].pos;
+			extend_position(&xp, ctx->positions + pos);
+			prepare_checks(&ci, &xp);
+		}
+
+		acc += move_into_check(&ci, ctx->positions + pos, &ctx->moves[i].move);
+	}
+
+	sink += acc;
+	return (ctx->nmove);
+}
+
+/*
+ * play_encode and undo_encode encode the positions resulting from all
+ * moves and unmoves by playing them and calling encode_position(),
+ * encode_move and encode_unmove do the same with a move_encoder
+ * prepared once per position.
+ */
+static size_t
+bench_play_encode(struct bench_ctx *ctx)
+{
+	struct position p;
+	poscode pc;
+	size_t i, n = 0;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->nmove; i++) {
+		if (!ctx->moves[i].encodable)
+			continue;
+
+		p = ctx->positions[ctx->moves[i].pos];
+		play_move(&p, &ctx->moves[i].move);
+		encode_position(&pc, &p);
+		acc += pc.map;
+		n++;
+	}
+
+	sink += acc;
+	return (n);
+}
+
+static size_t
+bench_encode_move(struct bench_ctx *ctx)
+{
+	struct move_encoder me;
+	poscode pc;
+	size_t i, n = 0, pos = -1;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->nmove; i++) {
+		if (!ctx->moves[i].encodable)
+			continue;
+
+		if (ctx->moves[i].pos != pos) {
+			pos = ctx->moves[i].pos;
+			prepare_encoder(&me, ctx->positions + pos);
+		}
+
+		encode_move(&pc, &me, ctx->positions + pos, &ctx->moves[i].move);
+		acc += pc.map;
+		n++;
+	}
+
+	sink += acc;
+	return (n);
+}
+
+static size_t
+bench_undo_encode(struct bench_ctx *ctx)
+{
+	struct position p;
+	poscode pc;
+	size_t i, n = 0;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->nunmove; i++) {
+		if (!ctx->unmoves[i].encodable)
+			continue;
+
+		p = ctx->positions[ctx->unmoves[i].pos];
+		undo_move(&p, &ctx->unmoves[i].unmove);
+		encode_position(&pc, &p);
+		acc += pc.map;
+		n++;
+	}
+
+	sink += acc;
+	return (n);
+}
+
+static size_t
+bench_encode_unmove(struct bench_ctx *ctx)
+{
+	struct move_encoder me;
+	poscode pc;
+	size_t i, n = 0, pos = -1;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->nunmove; i++) {
+		if (!ctx->unmoves[i].encodable)
+			continue;
+
+		if (ctx->unmoves[i].pos != pos) {
+			pos = ctx->unmoves[i].pos;
+			prepare_encoder(&me, ctx->positions + pos);
+		}
+
+		encode_unmove(&pc, &me, ctx->positions + pos, &ctx->unmoves[i].unmove);
+		acc += pc.map;
+		n++;
+	}
+
+	sink += acc;
+	return (n);
+}
+
+static size_t
+bench_lookup_position(struct bench_ctx *ctx)
+{
+	size_t i;
+	long long acc = 0;
+
+	for (i = 0; i < ctx->npos; i++)
+		acc += lookup_position(ctx->tb, ctx->positions + i);
+
+	sink += acc;
+	return (ctx->npos);
+}
+
+static size_t
+bench_lookup_positions(struct bench_ctx *ctx)
+{
+
+	lookup_positions(ctx->tb, ctx->positions, ctx->npos, ctx->entries);
+	sink += ctx->entries[ctx->npos - 1];
+
+	return (ctx->npos);
+}
+
+static size_t
+bench_analyze_position(struct bench_ctx *ctx)
+{
+	struct analysis an[MAX_MOVES];
+	size_t i;
+	unsigned long long acc = 0;
+
+	for (i = 0; i < ctx->npos; i++)
+		acc += analyze_position(an, ctx->tb, ctx->positions + i, MAX_STRENGTH);
+
+	sink += acc;
+	return (ctx->npos);
+}
+
+static size_t
+bench_load_raw(struct bench_ctx *ctx)
+{
+
+	free_tablebase(load_tablebase(ctx->rawfile, TB_WILLNEED | ctx->tbflags));
+	return (1);
+}
+
+static size_t
+bench_load_xz(struct bench_ctx *ctx)
+{
+
+	free_tablebase(load_tablebase(ctx->xzfile, ctx->tbflags));
+	return (1);
+}
+
+static size_t
+bench_gentb(struct bench_ctx *ctx)
+{
+	struct tablebase *tb;
+
+	tb = generate_tablebase(&ctx->gentb);
+	if (tb == NULL) {
+		perror("generate_tablebase");
+		exit(EXIT_FAILURE);
+	}
+
+	free_tablebase(tb);
+	return (1);
+}
+
+/*
+ * The same with the forward algorithm.
+ */
+static size_t
+bench_gentb_forward(struct bench_ctx *ctx)
+{
+	struct gentb_options opts = ctx->gentb;
+	struct tablebase *tb;
+
+	opts.algorithm = GENTB_FORWARD;
+	tb = generate_tablebase(&opts);
+	if (tb == NULL) {
+		perror("generate_tablebase");
+		exit(EXIT_FAILURE);
+	}
+
+	free_tablebase(tb);
+	return (1);
+}
+
+/*
+ * The same with the counter algorithm.
+ */
+static size_t
+bench_gentb_counter(struct bench_ctx *ctx)
+{
+	struct gentb_options opts = ctx->gentb;
+	struct tablebase *tb;
+
+	opts.algorithm = GENTB_COUNTER;
+	tb = generate_tablebase(&opts);
+	if (tb == NULL) {
+		perror("generate_tablebase");
+		exit(EXIT_FAILURE);
+	}
+
+	free_tablebase(tb);
+	return (1);
+}
+
+/*
+ * The same as gentb with pinned threads and memory placed on the node
+ * of the thread working on it, for comparison on NUMA machines.
+ */
+static size_t
+bench_gentb_local(struct bench_ctx *ctx)
+{
+	struct gentb_options opts = ctx->gentb;
+	struct tablebase *tb;
+
+	opts.placement = GENTB_PLACE_LOCAL;
+	tb = generate_tablebase(&opts);
+	if (tb == NULL) {
+		perror("generate_tablebase");
+		exit(EXIT_FAILURE);
+	}
+
+	free_tablebase(tb);
+	return (1);
+}
+
+/*
+ * The same with memory interleaved across the threads' nodes.
+ */
+static size_t
+bench_gentb_interleave(struct bench_ctx *ctx)
+{
+	struct gentb_options opts = ctx->gentb;
+	struct tablebase *tb;
+
+	opts.placement = GENTB_PLACE_INTERLEAVE;
+	tb = generate_tablebase(&opts);
+	if (tb == NULL) {
+		perror("generate_tablebase");
+		exit(EXIT_FAILURE);
+	}
+
+	free_tablebase(tb);
+	return (1);
+}
@@ -67,11 +67,12 @@ static struct gamestate *gs = NULL;
 static unsigned char engine_players = 0;
 static unsigned char show_board_after_move = 0;
 static double sente_strength = 1, gote_strength = 1;
+static int tbflags = TB_WILLNEED;
 static struct seed seed;
 static char *linebuf = NULL;
 
 /* internal functions */
-static void	open_tablebase(const char *);
+static void	open_tablebase(const char *, FILE *);
 static void	execute_command(char *);
 static void	end_game(void);
 static void	cmd_hint(const char *);
@@ -150,15 +151,15 @@ static const struct {
 extern int
 main(int argc, char *argv[])
 {
-	int optchar;
+	int optchar, server = 0, threads = 1;
 	unsigned char players = 0;
-	char *tbloc = getenv("DOBUTSU_TABLEBASE");
+	char *tbloc = getenv("DOBUTSU_TABLEBASE"), *socketpath = NULL;
 
 	setlocale(LC_ALL, "");
 	bindtextdomain("dobutsu", LOCALEDIR);
 	textdomain("dobutsu");
 
-	while (optchar = getopt(argc, argv, "c:qs:t:v"), optchar != EOF)
+	while (optchar = getopt(argc, argv, "Hc:j:lqSs:t:u:v"), optchar != EOF)
 		switch (optchar) {
 		case 'c':
 			while (*optarg != '\0')
@@ -184,10 +185,32 @@ main(int argc, char *argv[])
 
 			break;
 
+		case 'H':
+			tbflags |= TB_HUGEPAGE;
+			break;
+
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > SERVER_MAX_THREADS) {
+				fprintf(stderr, gettext("Number of threads must be between 1 and %d\n"),
+				    SERVER_MAX_THREADS);
+				return (EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'l':
+			tbflags |= TB_ONDEMAND;
+			break;
+
 		case 'q':
 			show_board_after_move = 0;
 			break;
 
+		case 'S':
+			server = 1;
+			break;
+
 		case 'v':
 			show_board_after_move = 1;
 			break;
@@ -217,18 +240,43 @@ main(int argc, char *argv[])
 			tbloc = optarg;
 			break;
 
+		case 'u':
+			socketpath = optarg;
+			server = 1;
+			break;
+
 		case ':':
 		case '?':
 		default:
 			return (EXIT_FAILURE);
 		}
 
+	/* keep standard output free for responses in server mode */
+	if (server) {
+		open_tablebase(tbloc, stderr);
+		if (tb == NULL)
+			return (EXIT_FAILURE);
+
+		if (socketpath != NULL) {
+			serve_socket(tb, socketpath, threads);
+			perror(socketpath);
+			return (EXIT_FAILURE);
+		}
+
+		if (serve_stream(tb, STDIN_FILENO, STDOUT_FILENO, threads) != 0) {
+			perror("serve_stream");
+			return (EXIT_FAILURE);
+		}
+
+		return (EXIT_SUCCESS);
+	}
+
 	/* for better interaction */
 	setbuf(stdin, NULL);
 	setbuf(stdout, NULL);
 
 	ai_seed(&seed);
-	open_tablebase(tbloc);
+	open_tablebase(tbloc, stdout);
 	cmd_new("");
 
 	engine_players = players;
@@ -249,14 +297,15 @@ main(int argc, char *argv[])
 /*
  * Open the endgame tablebase in file tbloc.  If tbloc is NULL,
  * try opening a file named dobutsu.tb in the current working
- * directory.  If that doesn't work either, give up.
+ * directory.  If that doesn't work either, give up.  Progress and
+ * errors are reported to msgfile.
  */
 static void
-open_tablebase(const char *tbloc)
+open_tablebase(const char *tbloc, FILE *msgfile)
 {
 	FILE *tbfile;
 
-	printf(gettext("Loading tablebase... "));
+	fprintf(msgfile, gettext("Loading tablebase... "));
 
 	if (tbloc != NULL)
 		tbfile = fopen(tbloc, "rb");
@@ -270,14 +319,15 @@ open_tablebase(const char *tbloc)
 	}
 
 	if (tbfile != NULL) {
-		tb = read_tablebase(tbfile);
+		tb = read_tablebase(tbfile, tbflags);
 		fclose(tbfile);
 	}
 
 	if (tb != NULL)
-		puts(gettext("done"));
+		fprintf(msgfile, "%s\n", gettext("done"));
 	else
-		printf("%s: %s\n", tbloc, errno == 0 ? gettext("Unknown error") : strerror(errno));
+		fprintf(msgfile, "%s: %s\n", tbloc,
+		    errno == 0 ? gettext("Unknown error") : strerror(errno));
 }
 
 /*
@@ -569,7 +619,8 @@ cmd_show_moves()
 
 /*
  * Lookup the current position in the tablebase and print its
- * evaluation.
+ * evaluation.  If the tablebase has no distance to mate information,
+ * print "win" or "loss" instead.
  */
 static void
 cmd_show_eval(void)
@@ -582,7 +633,9 @@ cmd_show_eval(void)
 	}
 
 	eval = lookup_position(tb, &gs->position);
-	if (is_win(eval))
+	if (!has_dtm(eval))
+		puts(is_win(eval) ? "win" : "loss");
+	else if (is_win(eval))
 		printf("#%d\n", get_dtm(eval));
 	else if (is_loss(eval))
 		printf("#-%d\n", get_dtm(eval));
@@ -611,6 +664,8 @@ cmd_show_lines(void)
 		move_string(movstr, &gs->position, &analysis[i].move);
 		if (is_draw(analysis[i].entry))
 			strcpy(dtmstr, "0");
+		else if (!has_dtm(analysis[i].entry))
+			strcpy(dtmstr, is_win(analysis[i].entry) ? "win" : "loss");
 		else
 			snprintf(dtmstr, sizeof dtmstr,
 			    is_win(analysis[i].entry) ? "#%d" : "#-%d",
@@ -48,6 +48,35 @@ enum {
         MAX_SQUARE = GOTE_PIECE + SQUARE_COUNT,
 };
 
+/*
+ * An xposition is a position extended with the squares attacked by
+ * each piece and, in threats, the squares attacked by both players
+ * with colours swapped like attack_map() in moves.c computes them.
+ * xplay_move() and xundo_move() keep these up to date, so the check
+ * tests xsente_in_check() and xgote_in_check() only need to combine a
+ * few bitmaps instead of computing the attack map from scratch.  Make
+ * an xposition from a position with extend_position().
+ */
+struct xposition {
+	struct position p;
+	board attacks[PIECE_COUNT], threats;
+};
+
+/*
+ * A check_info holds what move_into_check() needs to know about a
+ * position, see prepare_checks() in moves.c.  others[i] holds the
+ * squares attacked by the pieces of the owner of piece i other than
+ * piece i, theirs the squares attacked by the player not to move.
+ * own_lion and their_lion are the piece numbers of the lions of the
+ * player to move and the other player, promz the promotion zone of
+ * the other player, and ascend the squares in it the other lion could
+ * move to.
+ */
+struct check_info {
+	board others[PIECE_COUNT], theirs, promz, ascend;
+	unsigned own_lion, their_lion;
+};
+
 static inline	void	populate_map(struct position*);
 static inline	int	square_valid(unsigned);
 static inline	int	piece_in(board, unsigned);
@@ -57,6 +86,15 @@ static inline	int	is_promoted(unsigned, const struct position*);
 static inline	board	swap_colors(board);
 extern		board	moves_for(unsigned, const struct position*);
 extern const	board	roostertab[32];
+extern		void	extend_position(struct xposition*, const struct position*);
+extern		int	xplay_move(struct xposition*, const struct move*);
+extern		void	xundo_move(struct xposition*, const struct unmove*);
+static inline	int	xsente_in_check(const struct xposition*);
+static inline	int	xgote_in_check(const struct xposition*);
+extern		void	prepare_checks(struct check_info*, const struct xposition*);
+extern		int	move_into_check(const struct check_info*, const struct position*,
+			    const struct move*);
+extern		size_t	xgenerate_legal_moves(struct move[MAX_MOVES], const struct xposition*);
 
 /* inline implementations */
 
@@ -135,3 +173,25 @@ board swap_colors(board b)
 {
 	return (b << GOTE_PIECE | b >> GOTE_PIECE);
 }
+
+/*
+ * Like sente_in_check(), but for an xposition.
+ */
+static inline int
+xsente_in_check(const struct xposition *xp)
+{
+
+	return (piece_in(xp->threats, xp->p.pieces[LION_S])
+	    || (xp->attacks[LION_G] & ~xp->p.map & PROMZ_G & ~xp->threats) != 0);
+}
+
+/*
+ * Like gote_in_check(), but for an xposition.
+ */
+static inline int
+xgote_in_check(const struct xposition *xp)
+{
+
+	return (piece_in(xp->threats, xp->p.pieces[LION_G])
+	    || (xp->attacks[LION_S] & ~xp->p.map & PROMZ_S & ~xp->threats) != 0);
+}
@@ -23,6 +23,7 @@
  * SUCH DAMAGE.
  */
 #include <assert.h>
+#include <sys/types.h>
 
 #include "atomics.h"
 #include "tablebase.h"
@@ -33,6 +34,13 @@
  * as well as prototypes for functions used to implement it.
  */
 
+/* hint that the memory at addr is going to be read soon */
+#if __has_builtin(__builtin_prefetch) || defined(__GNUC__)
+# define prefetch(addr) __builtin_prefetch(addr)
+#else
+# define prefetch(addr) ((void)(addr))
+#endif
+
 /*
  * the endgame tablebase is organized on four levels:
  *  1. by piece ownership.
@@ -64,6 +72,8 @@ enum {
 	POSITION_TOTAL_COUNT = 255280704,
 	/* number of positions saved to disk (167527962) */
 	POSITION_COUNT = POSITION_TOTAL_COUNT / OWNERSHIP_TOTAL_COUNT * OWNERSHIP_COUNT,
+	/* size of a WDL tablebase with four positions per byte (41881991) */
+	WDL_SIZE = (POSITION_COUNT + 3) / 4,
 
 	MAX_PCALIAS = 16,
 };
@@ -118,14 +128,130 @@ extern const unsigned long long valid_ownership_map[COHORT_COUNT];
  */
 extern const unsigned char ownership_map[OWNERSHIP_TOTAL_COUNT];
 
+/*
+ * Every tablebase file begins with a header of TBHDR_SIZE bytes
+ * describing the tablebase that follows it.  When a tablebase is
+ * compressed, the header is compressed along with it; the xz stream
+ * header tells a compressed file apart from an uncompressed one.  The
+ * header is stored as follows, all numbers in little endian:
+ *
+ *   0  magic, the 8 bytes "DBTBFILE"
+ *   8  format version, TBHDR_VERSION
+ *  12  reserved, zero
+ *  16  value encoding, one of the TBHDR_* encodings
+ *  20  CRC32 of the tablebase following the header
+ *  24  size of the tablebase in bytes (8 bytes)
+ *  32  time of generation in seconds since the epoch (8 bytes)
+ *  40  number of rounds the generator ran
+ *  44  flags, a combination of TBHDR_INCOMPLETE
+ *  48  reserved, zero
+ *
+ * struct tbheader holds the decoded header, see tbheader.c.  Readers
+ * reject files with a version they don't know, so new formats can be
+ * introduced by bumping TBHDR_VERSION.  They also reject files with
+ * anything but zero at offset 12 or flagged TBHDR_INCOMPLETE.
+ */
+enum {
+	TBHDR_SIZE = 64,
+	TBHDR_VERSION = 1,
+
+	/* value encodings */
+	TBHDR_DTM = 0,	/* one tb_entry per byte, POSITION_COUNT bytes */
+	TBHDR_WDL = 1,	/* four WDL_* codes per byte, WDL_SIZE bytes */
+
+	/* flags */
+	TBHDR_INCOMPLETE = 1 << 0, /* generation stopped early */
+};
+
+struct tbheader {
+	unsigned version, encoding, crc, rounds, flags;
+	unsigned long long size, created;
+};
+
+extern		void			 encode_tbheader(unsigned char[TBHDR_SIZE],
+					     const struct tbheader *);
+extern		int			 decode_tbheader(struct tbheader *,
+					     const unsigned char[TBHDR_SIZE]);
+extern		unsigned		 tablebase_crc(const void *, size_t);
+
 /*
  * The tablebase struct contains a complete tablebase. It is essentially
- * just a huge array of position evaluations (win/draw/loss).
+ * just a huge array of POSITION_COUNT position evaluations
+ * (win/draw/loss).  The array is either allocated with malloc() or, if
+ * mapsize is nonzero, mapped read-only from a tablebase file or, after
+ * out-of-core generation, from a scratch file.  In the latter cases,
+ * map points to the beginning of the mapping which might be slightly
+ * before positions due to alignment.
+ *
+ * If wdl is set, the tablebase only records whether each position is
+ * won, drawn, or lost and positions points to WDL_SIZE bytes holding
+ * the WDL_* codes of four positions each, the first position in the
+ * least significant two bits.
+ *
+ * pages is one of the TB_PAGES_* constants and records what kind of
+ * pages back positions, see tballoc.c.  header describes the file
+ * the tablebase was read from or is going to be written to.
  */
 struct tablebase {
-	atomic_schar positions[POSITION_COUNT];
+	atomic_schar *positions;
+	void *map;
+	size_t mapsize;
+	int wdl, pages;
+	struct tbheader header;
+
+	/* blocks loaded on demand if positions is NULL, see tbaccess.c */
+	struct tbcache *cache;
+};
+
+enum {
+	TB_PAGES_DEFAULT,
+	TB_PAGES_TRANSPARENT,
+	TB_PAGES_HUGETLB,
+};
+
+extern		int			 alloc_positions(struct tablebase *, size_t, int);
+extern		void			 free_positions(struct tablebase *);
+extern		void			 finish_tablebase(struct tablebase *, const atomic_ulong *,
+					     const atomic_ulong *, unsigned, int);
+extern		struct tablebase	*generate_partitioned(const struct gentb_options *);
+extern		int			 thread_cpu(int);
+extern		int			 pin_thread(int);
+extern		int			 cpu_node(int);
+
+/*
+ * Codes for positions in a WDL tablebase.
+ */
+enum {
+	WDL_DRAW = 0,
+	WDL_WIN = 1,
+	WDL_LOSS = 2,
 };
 
+/*
+ * An xz_index describes the blocks an xz compressed tablebase is made
+ * of, see xzblock.c.  For each block, offset is the location of the
+ * compressed block in the file, insize its padded compressed size,
+ * outstart the offset of its uncompressed data in the tablebase and
+ * outsize the uncompressed size.  header is a copy of the stream
+ * header needed to decode individual blocks.
+ */
+struct xz_index {
+	unsigned char header[12];
+	size_t nblock, maxinsize, outsize;
+	struct xz_block {
+		off_t offset;
+		size_t insize, outstart, outsize;
+	} block[];
+};
+
+struct xz_dec;
+
+extern		struct xz_index		*read_xz_index(int, off_t);
+extern		int			 decode_xz_block(struct xz_dec *, int,
+					     const struct xz_index *, size_t,
+					     unsigned char *, unsigned char *);
+extern		size_t			 find_xz_block(const struct xz_index *, size_t);
+
 /*
  * A poscode (position code) is an encoded position directly suitable as
  * an index into the endgame tablebase.  A typedef is provided so we can
@@ -160,9 +286,46 @@ typedef struct {
 	unsigned map;
 } poscode;
 
+/*
+ * A move_encoder holds what encode_position() computes for all
+ * positions reachable from one position by a move or unmove that
+ * doesn't move a lion, see prepare_encoder() in poscode.c.  turn and
+ * mirror are the tables the board is transformed with, pieces the
+ * transformed pieces, lionpos the lion position code, and keys the
+ * keys of the squares left after placing the lions.
+ */
+struct move_encoder {
+	unsigned long long keys;
+	const unsigned char *turn, *mirror;
+	unsigned char pieces[PIECE_COUNT];
+	unsigned char lionpos;
+};
+
+/*
+ * A poscode_decoder decodes consecutive poscodes of one ownership and
+ * cohort, see start_decoder() in poscode.c.  pc is the current poscode
+ * and p the position it decodes to.  code holds the placement numbers
+ * of chicks, giraffes, and elephants pc.map is made of.  board_map,
+ * squares, and map hold the list of free squares, its length, and the
+ * occupied squares before placing each kind.
+ */
+struct poscode_decoder {
+	struct position p;
+	poscode pc;
+	unsigned code[3], map[3];
+	unsigned char board_map[3][SQUARE_COUNT], squares[3];
+};
+
 extern		void			encode_position(poscode*, const struct position*);
 extern		void			decode_poscode(struct position*, poscode);
+extern		void			start_decoder(struct poscode_decoder*, poscode);
+extern		void			next_poscode(struct poscode_decoder*);
 extern		int			position_mirror(struct position*);
+extern		void			prepare_encoder(struct move_encoder*, const struct position*);
+extern		void			encode_move(poscode*, const struct move_encoder*,
+					    const struct position*, const struct move*);
+extern		void			encode_unmove(poscode*, const struct move_encoder*,
+					    const struct position*, const struct unmove*);
 static inline	size_t			position_offset(poscode);
 static inline	int			has_valid_ownership(poscode);
 
@@ -172,6 +335,10 @@ static inline	int			has_valid_ownership(poscode);
  * position_offset() returns the offset of pc in the tablebase.  It is
  * assumed that pc represents a valid position code that is in the table
  * base (i.e. with lionpos < LIONPOS_TOTAL).
+ *
+ * The positions of one ownership and cohort form a contiguous chunk
+ * ordered by lionpos and map and positions whose ownership is stored
+ * come before the others.
  */
 static inline size_t
 position_offset(poscode pc)
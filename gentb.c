@@ -24,27 +24,126 @@
  */
 #define _POSIX_C_SOURCE 200809L
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "tablebase.h"
 
 /*
  * Generate the Dobutsu Shogi endgame tablebase, optionally in parallel.
- * The option -j nproc can be used to set the number of threads.
+ * The option -j nproc can be used to set the number of threads.  With
+ * -c checkpoint, the generator state is saved to checkpoint after a
+ * round if at least interval seconds (option -i, 60 by default) have
+ * passed since the last checkpoint.  With -r checkpoint, generation
+ * is resumed from a checkpoint.  With -T file, statistics for each
+ * round are written to file as JSON lines, file - meaning standard
+ * output.  With -w, only win/draw/loss information is written, see
+ * write_wdl_tablebase().  With -H, the tablebase is backed by huge
+ * pages if possible.  With -a forward, positions are evaluated by
+ * sweeping over all undecided positions each round instead of working
+ * backwards from the positions decided last (-a retrograde, the
+ * default).  -a counter works backwards, too, but keeps a count of
+ * undecided moves per position, trading memory for time.  With
+ * -d workdir, the tablebase is generated out of core with the counter
+ * algorithm, keeping it in scratch files in workdir and only holding
+ * partitions of about size MiB (option -m, 16 by default) of it in
+ * memory at a time.  With -p, each thread is pinned to a CPU of its
+ * own.  -P interleave spreads the memory of the tablebase under
+ * construction evenly across the NUMA nodes of the threads, -P local
+ * places the part each thread mostly works on on its own node.  Both
+ * imply -p.  By default (-P default), the system decides.  -d cannot
+ * be combined with -c, -r, -j, -H, -T, -p, -P or an algorithm other
+ * than counter.
  */
 extern int
 main(int argc, char *argv[])
 {
 	struct tablebase *tb;
+	struct gentb_options opts;
 	FILE *tbfile;
-	long threads = 1;
-	int optchar;
+	long threads = 1, interval, size;
+	int optchar, wdl = 0, algorithm = -1;
 	char *endptr;
 
-	while(optchar = getopt(argc, argv, "j:"), optchar != -1)
+	opts.flags = 0;
+	opts.pin = 0;
+	opts.placement = GENTB_PLACE_DEFAULT;
+	opts.checkpoint_interval = 60;
+	opts.max_rounds = 0;
+	opts.checkpoint = NULL;
+	opts.resume = NULL;
+	opts.workdir = NULL;
+	opts.partition_size = 16 * 1024 * 1024;
+	opts.telemetry = NULL;
+
+	while(optchar = getopt(argc, argv, "HP:T:a:c:d:i:j:m:pr:w"), optchar != -1)
 		switch(optchar) {
+		case 'H':
+			opts.flags |= TB_HUGEPAGE;
+			break;
+
+		case 'P':
+			if (strcmp(optarg, "default") == 0)
+				opts.placement = GENTB_PLACE_DEFAULT;
+			else if (strcmp(optarg, "interleave") == 0)
+				opts.placement = GENTB_PLACE_INTERLEAVE;
+			else if (strcmp(optarg, "local") == 0)
+				opts.placement = GENTB_PLACE_LOCAL;
+			else {
+				fprintf(stderr, "Unknown placement %s\n", optarg);
+				goto usage;
+			}
+
+			break;
+
+		case 'T':
+			if (strcmp(optarg, "-") == 0)
+				opts.telemetry = stdout;
+			else if (opts.telemetry = fopen(optarg, "w"), opts.telemetry == NULL) {
+				perror(optarg);
+				return (EXIT_FAILURE);
+			}
+
+			break;
+
+		case 'a':
+			if (strcmp(optarg, "retrograde") == 0)
+				algorithm = GENTB_RETROGRADE;
+			else if (strcmp(optarg, "forward") == 0)
+				algorithm = GENTB_FORWARD;
+			else if (strcmp(optarg, "counter") == 0)
+				algorithm = GENTB_COUNTER;
+			else {
+				fprintf(stderr, "Unknown algorithm %s\n", optarg);
+				goto usage;
+			}
+
+			break;
+
+		case 'c':
+			opts.checkpoint = optarg;
+			break;
+
+		case 'd':
+			opts.workdir = optarg;
+			break;
+
+		case 'i':
+			interval = strtol(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || interval < 0) {
+				fprintf(stderr, "A non-negative checkpoint interval is expected\n");
+				return (EXIT_FAILURE);
+			}
+
+			if (interval > UINT_MAX)
+				interval = UINT_MAX;
+
+			opts.checkpoint_interval = interval;
+			break;
+
 		case 'j':
 			threads = strtol(optarg, &endptr, 0);
 			if (*optarg == '\0' || *endptr != '\0' || threads <= 0) {
@@ -57,6 +156,31 @@ main(int argc, char *argv[])
 
 			break;
 
+		case 'm':
+			size = strtol(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || size <= 0) {
+				fprintf(stderr, "A positive partition size is expected\n");
+				return (EXIT_FAILURE);
+			}
+
+			if ((unsigned long)size > SIZE_MAX / (1024 * 1024))
+				size = SIZE_MAX / (1024 * 1024);
+
+			opts.partition_size = (size_t)size * 1024 * 1024;
+			break;
+
+		case 'p':
+			opts.pin = 1;
+			break;
+
+		case 'r':
+			opts.resume = optarg;
+			break;
+
+		case 'w':
+			wdl = 1;
+			break;
+
 		case '?':
 		default:
 			goto usage;
@@ -65,7 +189,9 @@ main(int argc, char *argv[])
 
 	if (argc - optind != 1) {
 	usage:
-		fprintf(stderr, "Usage: %s [-j nproc] dobutsu.tb\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-Hp] [-a retrograde|forward|counter] [-j nproc] [-c checkpoint] "
+		    "[-i interval] [-r checkpoint] [-d workdir] [-m size] [-P default|interleave|local] "
+		    "[-T telemetry] [-w] dobutsu.tb\n", argv[0]);
 		return (EXIT_FAILURE);
 	}
 
@@ -75,13 +201,23 @@ main(int argc, char *argv[])
 		return (EXIT_FAILURE);
 	}
 
-	tb = generate_tablebase(threads);
+	/* -d implies -a counter, anything else is rejected */
+	if (algorithm != -1)
+		opts.algorithm = algorithm;
+	else
+		opts.algorithm = opts.workdir != NULL ? GENTB_COUNTER : GENTB_RETROGRADE;
+
+	opts.threads = threads;
+	tb = generate_tablebase(&opts);
 	if (tb == NULL) {
 		perror("generate_tablebase");
 		return (EXIT_FAILURE);
 	}
 
-	if (write_tablebase(tbfile, tb)) {
+	if (opts.flags & TB_HUGEPAGE)
+		fprintf(stderr, "Tablebase pages: %s\n", tablebase_pages(tb));
+
+	if ((wdl ? write_wdl_tablebase : write_tablebase)(tbfile, tb)) {
 		perror("write_tablebase");
 		return (EXIT_FAILURE);
 	}
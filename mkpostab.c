@@ -0,0 +1,219 @@
+/*-
+ * Copyright (c) 2016--2017 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rules.h"
+
+/*
+ * This program generates postab.h, the lookup tables encode_pieces()
+ * in poscode.c uses to compute the map part of a poscode.  See there
+ * for how they are used.  The tables are derived by carrying out the
+ * square removals of the original encoding algorithm, so the codes
+ * computed with them are the same.
+ *
+ * A square's key is its index in the list of remaining squares plus
+ * one.  Key 0 stands for a piece in hand.  A key map holds the key of
+ * each square and of IN_HAND in one nibble each.
+ */
+
+enum {
+	/* number of remaining squares when encoding the first piece kind */
+	FIRST_SQUARES = SQUARE_COUNT - 2,
+
+	/* ... and when encoding the last piece kind needing a remap */
+	LAST_SQUARES = SQUARE_COUNT - 4,
+
+	KEY_COUNT = FIRST_SQUARES + 1,
+};
+
+static void	remove_square(unsigned char *, unsigned, unsigned);
+static void	print_lion_keys(void);
+static void	print_piece_remap(void);
+static void	print_piece_rank(void);
+static void	print_piece_choices(void);
+
+extern int
+main(void)
+{
+
+	printf("/* generated by mkpostab, do not edit */\n\n");
+	printf("enum {\n\tFIRST_SQUARES = %d,\n\tLAST_SQUARES = %d,\n};\n\n",
+	    FIRST_SQUARES, LAST_SQUARES);
+
+	print_lion_keys();
+	print_piece_remap();
+	print_piece_rank();
+	print_piece_choices();
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		perror("mkpostab");
+		return (EXIT_FAILURE);
+	}
+
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Remove the entry at index sq from the n + 1 entries long list,
+ * moving the last entry into its place.
+ */
+static void
+remove_square(unsigned char *list, unsigned n, unsigned sq)
+{
+
+	list[sq] = list[n];
+}
+
+/*
+ * lion_keys[s][g] is the key map after removing the squares of a
+ * lion on square s and another on square g, larger square first.
+ */
+static void
+print_lion_keys(void)
+{
+	unsigned char list[SQUARE_COUNT];
+	unsigned long long keys;
+	unsigned s, g, i;
+
+	printf("static const unsigned long long lion_keys[SQUARE_COUNT][SQUARE_COUNT] = {\n");
+	for (s = 0; s < SQUARE_COUNT; s++) {
+		printf("\t{");
+		for (g = 0; g < SQUARE_COUNT; g++) {
+			for (i = 0; i < SQUARE_COUNT; i++)
+				list[i] = i;
+
+			keys = 0;
+			if (s != g) {
+				remove_square(list, SQUARE_COUNT - 1, s > g ? s : g);
+				remove_square(list, SQUARE_COUNT - 2, s > g ? g : s);
+				for (i = 0; i < FIRST_SQUARES; i++)
+					keys |= (i + 1ULL) << 4 * list[i];
+			}
+
+			printf("%s0x%012llx,", g % 3 == 0 ? "\n\t\t" : " ", keys);
+		}
+
+		printf("\n\t},\n");
+	}
+
+	printf("};\n\n");
+}
+
+/*
+ * piece_remap[n - LAST_SQUARES][hi][lo] maps the keys of the n
+ * remaining squares to their keys after removing the squares with
+ * keys hi and lo (0 for none), hi first.  The result is a key map
+ * indexed by key instead of square.
+ */
+static void
+print_piece_remap(void)
+{
+	unsigned char list[FIRST_SQUARES];
+	unsigned long long keys;
+	unsigned n, hi, lo, m, i;
+
+	printf("static const unsigned long long piece_remap[FIRST_SQUARES - LAST_SQUARES + 1]"
+	    "[FIRST_SQUARES + 1][FIRST_SQUARES + 1] = {\n");
+	for (n = LAST_SQUARES; n <= FIRST_SQUARES; n++) {
+		printf("\t{");
+		for (hi = 0; hi < KEY_COUNT; hi++) {
+			printf("\n\t\t{");
+			for (lo = 0; lo < KEY_COUNT; lo++) {
+				keys = 0;
+				if (hi <= n && (lo < hi || (hi == 0 && lo == 0))) {
+					for (i = 0; i < n; i++)
+						list[i] = i + 1;
+
+					m = n;
+					if (hi != 0)
+						remove_square(list, --m, hi - 1);
+					if (lo != 0)
+						remove_square(list, --m, lo - 1);
+
+					for (i = 0; i < m; i++)
+						keys |= (unsigned long long)(i + 1) << 4 * list[i];
+				}
+
+				printf("%s0x%012llx,", lo % 3 == 0 ? "\n\t\t\t" : " ", keys);
+			}
+
+			printf("\n\t\t},");
+		}
+
+		printf("\n\t},\n");
+	}
+
+	printf("};\n\n");
+}
+
+/*
+ * piece_rank[hi][lo] is the number describing the placement of a pair
+ * of pieces with keys hi and lo, where hi >= lo.  With only one piece
+ * on the board (lo == 0), this is its key minus one.  For two pieces,
+ * the pairs are numbered by hi first, lo second, see pair_map in
+ * poscode.c.
+ */
+static void
+print_piece_rank(void)
+{
+	unsigned hi, lo, rank;
+
+	printf("static const unsigned char piece_rank[FIRST_SQUARES + 1][FIRST_SQUARES + 1] = {\n");
+	for (hi = 0; hi < KEY_COUNT; hi++) {
+		printf("\t{");
+		for (lo = 0; lo < KEY_COUNT; lo++) {
+			if (hi == 0 || lo >= hi)
+				rank = 0;
+			else if (lo == 0)
+				rank = hi - 1;
+			else
+				rank = (hi - 1) * (hi - 2) / 2 + lo - 1;
+
+			printf(" %2u,", rank);
+		}
+
+		printf(" },\n");
+	}
+
+	printf("};\n\n");
+}
+
+/*
+ * piece_choices[n][bits] is the number of ways to place the pieces
+ * of one kind on n remaining squares where bits is 0 for no piece on
+ * the board, 1 for one piece, and 3 for two pieces.
+ */
+static void
+print_piece_choices(void)
+{
+	unsigned n;
+
+	printf("static const unsigned char piece_choices[FIRST_SQUARES + 1][4] = {\n");
+	for (n = 0; n < KEY_COUNT; n++)
+		printf("\t{ 1, %2u, 0, %2u },\n", n, n * (n - 1) / 2);
+
+	printf("};\n");
+}
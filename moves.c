@@ -93,6 +93,147 @@ attack_map(const struct position *p)
 	return (swap_colors(b));
 }
 
+/*
+ * Return the squares piece pc attacks in p.
+ */
+static board
+piece_attacks(unsigned pc, const struct position *p)
+{
+
+	return (pc < GIRA_S && is_promoted(pc, p)
+	    ? roostertab[p->pieces[pc]] : movetab[pc / 2][p->pieces[pc]]);
+}
+
+/*
+ * Recompute xp->threats from xp->attacks.
+ */
+static void
+update_threats(struct xposition *xp)
+{
+	board b = 0;
+	size_t i;
+
+	for (i = 0; i < PIECE_COUNT; i++)
+		b |= xp->attacks[i];
+
+	xp->threats = swap_colors(b);
+}
+
+/*
+ * Make an xposition from p.
+ */
+extern void
+extend_position(struct xposition *xp, const struct position *p)
+{
+	size_t i;
+
+	xp->p = *p;
+	for (i = 0; i < PIECE_COUNT; i++)
+		xp->attacks[i] = piece_attacks(i, p);
+
+	update_threats(xp);
+}
+
+/*
+ * Play move m on p as described for play_move() and return what it
+ * returns.  threats is the attack map of p as computed by attack_map()
+ * or NULL to have it computed if needed.  The index of the captured
+ * piece or -1 if none is stored to *captured.
+ */
+static int
+move_piece(struct position *p, const struct move *m, const board *threats, int *captured)
+{
+	unsigned status = p->status;
+	int ret = 0, i;
+	board oldmap = p->map;
+
+	/* update occupation map to board state after move */
+	p->map &= ~(1 << p->pieces[m->piece]);
+	p->map &= ~(1 << (m->to ^ GOTE_PIECE));
+	p->map |= 1 << m->to;
+	p->map &= BOARD;
+
+	/* do promotion and ascension */
+	if (!piece_in(HAND, p->pieces[m->piece])
+	    && piece_in(PROMZ_G | PROMZ_S, m->to)) {
+		status |= 1 << m->piece;
+
+		/* did an ascension happen? Check if lion is in danger. */
+		if (status & (1 << LION_S | 1 << LION_G))
+			ret = !piece_in(threats != NULL ? *threats : attack_map(p), m->to);
+
+	}
+
+	p->pieces[m->piece] = m->to;
+
+	/* clear promotion bits for pieces that can't be promoted */
+	status &= POS_FLAGS;
+
+	/* do capture */
+	*captured = -1;
+	if (piece_in(oldmap, m->to ^ GOTE_PIECE)) {
+		/*
+		 * Since we checked, there is a piece to be captured, so
+		 * if it's none of the others, it's the last one.
+		 */
+		for (i = 0; i < PIECE_COUNT - 1; i++)
+			if (p->pieces[i] == (m->to ^ GOTE_PIECE))
+				break;
+
+		assert(p->pieces[i] == (m->to ^ GOTE_PIECE));
+
+		/* move captured piece to hand and flip ownership */
+		p->pieces[i] = (p->pieces[i] & GOTE_PIECE) ^ (IN_HAND | GOTE_PIECE);
+
+		/* unpromote captured piece */
+		status &= ~(1 << i);
+		*captured = i;
+
+		/* check for captured king */
+		if (i == LION_S || i == LION_G)
+			ret = 1;
+	}
+
+	p->status = status ^ GOTE_MOVES;
+
+	return (ret);
+}
+
+/*
+ * Like play_move(), but for an xposition.  The attack map for the
+ * ascension check is already at hand.  Only the attacks of the moving
+ * piece and of the captured piece, if any, change.
+ */
+extern int
+xplay_move(struct xposition *xp, const struct move *m)
+{
+	int ret, captured;
+
+	ret = move_piece(&xp->p, m, &xp->threats, &captured);
+	if (captured >= 0)
+		xp->attacks[captured] = 0;
+
+	xp->attacks[m->piece] = piece_attacks(m->piece, &xp->p);
+	update_threats(xp);
+
+	return (ret);
+}
+
+/*
+ * Like undo_move(), but for an xposition.
+ */
+extern void
+xundo_move(struct xposition *xp, const struct unmove *u)
+{
+
+	undo_move(&xp->p, u);
+	xp->attacks[u->piece] = piece_attacks(u->piece, &xp->p);
+	if (u->capture >= 0)
+		xp->attacks[u->capture] = piece_attacks(u->capture, &xp->p);
+
+	update_threats(xp);
+}
+
 /*
  * Compute the possible moves for piece pc in p.  Both moving into
  * check and not moving out of check comprises a legal move.
@@ -159,6 +300,98 @@ gote_in_check(const struct position *p)
 	return (0);
 }
 
+/*
+ * Prepare ci for determining which moves in xp leave the player who
+ * moves in check with move_into_check().  For each piece, the squares
+ * attacked by the other pieces of its owner are recorded, as well as
+ * the squares the other lion could ascend to if they were not
+ * attacked.
+ */
+extern void
+prepare_checks(struct check_info *ci, const struct xposition *xp)
+{
+	const struct position *p = &xp->p;
+	board attacks[2][PIECE_COUNT], before[2], after[2];
+	size_t i;
+	int owner[PIECE_COUNT], gote = gote_moves(p) != 0;
+
+	ci->own_lion = gote ? LION_G : LION_S;
+	ci->their_lion = gote ? LION_S : LION_G;
+	ci->promz = gote ? PROMZ_S : PROMZ_G;
+
+	for (i = 0; i < PIECE_COUNT; i++) {
+		owner[i] = gote_owns(p->pieces[i]) != 0;
+		attacks[owner[i]][i] = xp->attacks[i];
+		attacks[!owner[i]][i] = 0;
+	}
+
+	/* others[i] is the OR of the attacks before and after piece i */
+	before[0] = before[1] = 0;
+	for (i = 0; i < PIECE_COUNT; i++) {
+		ci->others[i] = before[owner[i]];
+		before[0] |= attacks[0][i];
+		before[1] |= attacks[1][i];
+	}
+
+	ci->theirs = before[!gote];
+
+	after[0] = after[1] = 0;
+	for (i = PIECE_COUNT; i-- > 0; ) {
+		ci->others[i] |= after[owner[i]];
+		after[0] |= attacks[0][i];
+		after[1] |= attacks[1][i];
+	}
+
+	ci->ascend = xp->attacks[ci->their_lion] & ~p->map & ci->promz;
+}
+
+/*
+ * Return 1 if playing m on p, for whose xposition ci has been prepared
+ * with prepare_checks(), leaves the player who moves in check, that is, if
+ * sente_in_check() or gote_in_check() holds for that player after
+ * playing m.  Otherwise return 0.  The result is meaningless if m
+ * ends the game.
+ *
+ * The result is derived from the attacks computed beforehand: the
+ * moving piece only changes its own attacks and a capture only removes
+ * the attacks of the captured piece.
+ */
+extern int
+move_into_check(const struct check_info *ci, const struct position *p, const struct move *m)
+{
+	board mine, theirs = ci->theirs, ascend = ci->ascend;
+	size_t i;
+	unsigned lion, victim = m->to ^ GOTE_PIECE;
+
+	if (piece_in(p->map, victim)) {
+		for (i = 0; p->pieces[i] != victim; i++)
+			;
+
+		theirs = ci->others[i];
+
+		/* the other lion may now take the capturing piece */
+		ascend |= movetab[LION_S / 2][p->pieces[ci->their_lion]] & ci->promz & 1 << victim;
+	}
+
+	lion = m->piece == ci->own_lion ? m->to : p->pieces[ci->own_lion];
+	if (piece_in(swap_colors(theirs), lion))
+		return (1);
+
+	if (ascend == 0)
+		return (0);
+
+	/* see play_move() */
+	if (m->piece < GIRA_S && (is_promoted(m->piece, p)
+	    || (!piece_in(HAND, p->pieces[m->piece]) && piece_in(PROMZ_G | PROMZ_S, m->to))))
+		mine = roostertab[m->to];
+	else
+		mine = movetab[m->piece / 2][m->to];
+
+	mine |= ci->others[m->piece];
+
+	return (!!(ascend & ~swap_colors(mine)));
+}
+
 /*
  * Generate all moves for pc and add them to moves.
  */
@@ -205,60 +438,78 @@ generate_moves(struct move moves[MAX_MOVES], const struct position *p)
 }
 
 /*
- * Play move m on position p.  No sanity checks are performed.  This
- * function returns 1 if the move played ended the game by taking the
- * opponent's lion or by ascending.
+ * Generate the moves for the player who has the right to move in p
+ * that do not leave that player in check, as well as the moves that
+ * end the game.  Return the number of moves generated.  This is the
+ * same as generating all moves with generate_moves() and discarding
+ * those after which sente_in_check() or gote_in_check() holds for the
+ * player who moved, but no move needs to be played.
  */
-extern int
-play_move(struct position *p, const struct move *m)
+extern size_t
+generate_legal_moves(struct move moves[MAX_MOVES], const struct position *p)
 {
-	unsigned status = p->status;
-	int ret = 0, i;
-	board oldmap = p->map;
+	struct xposition xp;
 
-	/* update occupation map to board state after move */
-	p->map &= ~(1 << p->pieces[m->piece]);
-	p->map &= ~(1 << (m->to ^ GOTE_PIECE));
-	p->map |= 1 << m->to;
-	p->map &= BOARD;
+	extend_position(&xp, p);
 
-	/* do promotion and ascension */
-	if (!piece_in(HAND, p->pieces[m->piece])
-	    && piece_in(PROMZ_G | PROMZ_S, m->to)) {
-		status |= 1 << m->piece;
-
-		/* did an ascension happen? Check if lion is in danger. */
-		if (status & (1 << LION_S | 1 << LION_G))
-			ret = !piece_in(attack_map(p), m->to);
+	return (xgenerate_legal_moves(moves, &xp));
+}
 
+/*
+ * Like generate_legal_moves(), but for an xposition.
+ */
+extern size_t
+xgenerate_legal_moves(struct move moves[MAX_MOVES], const struct xposition *xp)
+{
+	struct check_info ci;
+	board threats;
+	size_t i, nmove, nlegal = 0;
+	unsigned to;
+
+	nmove = generate_moves(moves, &xp->p);
+	prepare_checks(&ci, xp);
+
+	/*
+	 * If the lion is not attacked and the other lion is not next to
+	 * its promotion zone, only lion moves to attacked squares can be
+	 * into check.
+	 */
+	threats = swap_colors(ci.theirs);
+	if (!piece_in(threats, xp->p.pieces[ci.own_lion])
+	    && (xp->attacks[ci.their_lion] & ci.promz) == 0) {
+		for (i = 0; i < nmove; i++)
+			if (moves[i].piece != ci.own_lion || !piece_in(threats, moves[i].to)
+			    || (moves[i].to ^ GOTE_PIECE) == xp->p.pieces[ci.their_lion])
+				moves[nlegal++] = moves[i];
+
+		return (nlegal);
 	}
 
-	p->pieces[m->piece] = m->to;
-
-	/* clear promotion bits for pieces that can't be promoted */
-	status &= POS_FLAGS;
-
-	/* do capture */
-	if (piece_in(oldmap, m->to ^ GOTE_PIECE)) {
-		for (i = 0; i < PIECE_COUNT; i++)
-			if (p->pieces[i] == (m->to ^ GOTE_PIECE))
-				break;
-
-		/* since we checked, there should be a piece to be captured */
-		assert(i < PIECE_COUNT);
+	for (i = 0; i < nmove; i++) {
+		to = moves[i].to;
 
-		/* move captured piece to hand and flip ownership */
-		p->pieces[i] = (p->pieces[i] & GOTE_PIECE) ^ (IN_HAND | GOTE_PIECE);
+		/* moves taking the other lion or ascending end the game */
+		if (move_into_check(&ci, &xp->p, moves + i)
+		    && (to ^ GOTE_PIECE) != xp->p.pieces[ci.their_lion]
+		    && (moves[i].piece != ci.own_lion || !piece_in(PROMZ_S | PROMZ_G, to)
+		    || piece_in(threats, to)))
+			continue;
 
-		/* unpromote captured piece */
-		status &= ~(1 << i);
-
-		/* check for captured king */
-		if (i == LION_S || i == LION_G)
-			ret = 1;
+		moves[nlegal++] = moves[i];
 	}
 
-	p->status = status ^ GOTE_MOVES;
+	return (nlegal);
+}
 
-	return (ret);
+/*
+ * Play move m on position p.  No sanity checks are performed.  This
+ * function returns 1 if the move played ended the game by taking the
+ * opponent's lion or by ascending.
+ */
+extern int
+play_move(struct position *p, const struct move *m)
+{
+	int captured;
+
+	return (move_piece(p, m, NULL, &captured));
 }
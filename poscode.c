@@ -23,17 +23,119 @@
  * SUCH DAMAGE.
  */
 #include <assert.h>
+#include <string.h>
 
 #include "dobutsutable.h"
+#include "postab.h"
 
 static void	mirror_board(struct position *);
 static void	turn_board(struct position *);
 static void	normalize_position(struct position *);
-static unsigned	encode_ownership(const struct position *);
+static unsigned	encode_ownership(const unsigned char[PIECE_COUNT]);
 static void	encode_pieces(poscode *, struct position *);
+static inline unsigned place_lions(unsigned long long *, unsigned, unsigned);
+static inline void encode_others(poscode *, const unsigned char[PIECE_COUNT], unsigned,
+		    unsigned long long);
+static void	encode_changed(poscode *, const struct move_encoder *, unsigned char[PIECE_COUNT],
+		    unsigned);
 static void	place_pieces(struct position *, unsigned, unsigned, unsigned);
+static void	place_lions_at(struct poscode_decoder *);
+static void	place_kind(struct poscode_decoder *, unsigned);
 static void	assign_ownership(struct position *, unsigned);
 
+/*
+ * Tables mapping each piece location (square or IN_HAND, with or
+ * without GOTE_PIECE) to its location after transforming the board.
+ * same_board leaves everything in place, flipped_board mirrors the
+ * board along the B file, and turned_board turns it 180 degrees,
+ * exchanging Sente and Gote.
+ */
+static const unsigned char same_board[(GOTE_PIECE | IN_HAND) + 1] = {
+	[ 0] =  0,
+	[ 1] =  1,
+	[ 2] =  2,
+	[ 3] =  3,
+	[ 4] =  4,
+	[ 5] =  5,
+	[ 6] =  6,
+	[ 7] =  7,
+	[ 8] =  8,
+	[ 9] =  9,
+	[10] = 10,
+	[11] = 11,
+	[IN_HAND] = IN_HAND,
+
+	[GOTE_PIECE |  0] = GOTE_PIECE |  0,
+	[GOTE_PIECE |  1] = GOTE_PIECE |  1,
+	[GOTE_PIECE |  2] = GOTE_PIECE |  2,
+	[GOTE_PIECE |  3] = GOTE_PIECE |  3,
+	[GOTE_PIECE |  4] = GOTE_PIECE |  4,
+	[GOTE_PIECE |  5] = GOTE_PIECE |  5,
+	[GOTE_PIECE |  6] = GOTE_PIECE |  6,
+	[GOTE_PIECE |  7] = GOTE_PIECE |  7,
+	[GOTE_PIECE |  8] = GOTE_PIECE |  8,
+	[GOTE_PIECE |  9] = GOTE_PIECE |  9,
+	[GOTE_PIECE | 10] = GOTE_PIECE | 10,
+	[GOTE_PIECE | 11] = GOTE_PIECE | 11,
+	[GOTE_PIECE | IN_HAND] = GOTE_PIECE | IN_HAND,
+}, flipped_board[(GOTE_PIECE | IN_HAND) + 1] = {
+	[ 0] = 2,
+	[ 1] = 1,
+	[ 2] = 0,
+	[ 3] = 5,
+	[ 4] = 4,
+	[ 5] = 3,
+	[ 6] = 8,
+	[ 7] = 7,
+	[ 8] = 6,
+	[ 9] = 11,
+	[10] = 10,
+	[11] = 9,
+	[IN_HAND] = IN_HAND,
+
+	[GOTE_PIECE | 0] = GOTE_PIECE | 2,
+	[GOTE_PIECE | 1] = GOTE_PIECE | 1,
+	[GOTE_PIECE | 2] = GOTE_PIECE | 0,
+	[GOTE_PIECE | 3] = GOTE_PIECE | 5,
+	[GOTE_PIECE | 4] = GOTE_PIECE | 4,
+	[GOTE_PIECE | 5] = GOTE_PIECE | 3,
+	[GOTE_PIECE | 6] = GOTE_PIECE | 8,
+	[GOTE_PIECE | 7] = GOTE_PIECE | 7,
+	[GOTE_PIECE | 8] = GOTE_PIECE | 6,
+	[GOTE_PIECE | 9] = GOTE_PIECE | 11,
+	[GOTE_PIECE |10] = GOTE_PIECE | 10,
+	[GOTE_PIECE |11] = GOTE_PIECE | 9,
+	[GOTE_PIECE |IN_HAND] = GOTE_PIECE | IN_HAND,
+}, turned_board[(GOTE_PIECE | IN_HAND) + 1] = {
+	[ 0] = GOTE_PIECE | 11,
+	[ 1] = GOTE_PIECE | 10,
+	[ 2] = GOTE_PIECE |  9,
+	[ 3] = GOTE_PIECE |  8,
+	[ 4] = GOTE_PIECE |  7,
+	[ 5] = GOTE_PIECE |  6,
+	[ 6] = GOTE_PIECE |  5,
+	[ 7] = GOTE_PIECE |  4,
+	[ 8] = GOTE_PIECE |  3,
+	[ 9] = GOTE_PIECE |  2,
+	[10] = GOTE_PIECE |  1,
+	[11] = GOTE_PIECE |  0,
+	[IN_HAND] = GOTE_PIECE | IN_HAND,
+
+	[GOTE_PIECE |  0] = 11,
+	[GOTE_PIECE |  1] = 10,
+	[GOTE_PIECE |  2] =  9,
+	[GOTE_PIECE |  3] =  8,
+	[GOTE_PIECE |  4] =  7,
+	[GOTE_PIECE |  5] =  6,
+	[GOTE_PIECE |  6] =  5,
+	[GOTE_PIECE |  7] =  4,
+	[GOTE_PIECE |  8] =  3,
+	[GOTE_PIECE |  9] =  2,
+	[GOTE_PIECE | 10] =  1,
+	[GOTE_PIECE | 11] =  0,
+	[GOTE_PIECE | IN_HAND] = IN_HAND,
+};
+
 /*
  * Encode a position structure into a tablebase index (poscode).  It is
  * assumed that p encodes a valid position.
@@ -44,12 +146,132 @@ encode_position(poscode *pc, const struct position *pos)
 	struct position p = *pos;
 
 	normalize_position(&p);
-	pc->ownership = encode_ownership(&p);
+	pc->ownership = encode_ownership(p.pieces);
 	encode_pieces(pc, &p);
 
 	assert(has_valid_ownership(*pc));
 }
 
+/*
+ * Prepare me for encoding the positions reachable from p by one move
+ * or unmove with encode_move() and encode_unmove().  Such positions
+ * have the other side to move, so the board is turned the same way
+ * for all of them when normalizing.  Unless a lion moves, the lions
+ * stay where they are, so the board is mirrored the same way, too,
+ * and lionpos as well as the squares left for the other pieces after
+ * placing the lions are the same.  This function computes these once.
+ * If the lions of p are placed such that the position cannot be
+ * encoded this way, me is marked such that the other functions defer
+ * to encode_position().
+ */
+extern void
+prepare_encoder(struct move_encoder *me, const struct position *p)
+{
+	size_t i;
+	unsigned sente_lion, gote_lion;
+	int turn = !gote_moves(p);
+
+	me->turn = turn ? turned_board : same_board;
+
+	/* turning the board exchanges the lions */
+	sente_lion = me->turn[p->pieces[turn ? LION_G : LION_S]];
+	gote_lion = me->turn[p->pieces[turn ? LION_S : LION_G]];
+
+	/* see normalize_position() */
+	if (piece_in(00444, sente_lion)
+	    || (piece_in(02222, sente_lion) && piece_in(01111 << GOTE_PIECE, gote_lion)))
+		me->mirror = flipped_board;
+	else
+		me->mirror = same_board;
+
+	for (i = 0; i < LION_S; i++)
+		me->pieces[i] = me->mirror[me->turn[p->pieces[i]]];
+
+	me->pieces[LION_S] = me->mirror[sente_lion];
+	me->pieces[LION_G] = me->mirror[gote_lion];
+
+	sente_lion = me->pieces[LION_S];
+	gote_lion = me->pieces[LION_G] & ~GOTE_PIECE;
+	if (sente_lion < SQUARE_COUNT - 4 && gote_lion >= 3)
+		me->lionpos = place_lions(&me->keys, sente_lion, gote_lion);
+	else
+		me->lionpos = -1;
+}
+
+/*
+ * Encode the position resulting from playing m on p into pc, where me
+ * has been prepared for p with prepare_encoder().  The result is the
+ * same as that of play_move() followed by encode_position().  m must
+ * not end the game.
+ */
+extern void
+encode_move(poscode *pc, const struct move_encoder *me, const struct position *p,
+    const struct move *m)
+{
+	struct position pp;
+	size_t i;
+	unsigned status = p->status & (ROST_S | ROST_G);
+	unsigned char pieces[PIECE_COUNT];
+
+	if (m->piece >= LION_S || me->lionpos == (unsigned char)-1) {
+		pp = *p;
+		play_move(&pp, m);
+		encode_position(pc, &pp);
+		return;
+	}
+
+	memcpy(pieces, me->pieces, sizeof pieces);
+
+	/* see play_move() */
+	if (!piece_in(HAND, p->pieces[m->piece]) && piece_in(PROMZ_G | PROMZ_S, m->to))
+		status |= 1 << m->piece & (ROST_S | ROST_G);
+
+	if (piece_in(p->map, m->to ^ GOTE_PIECE)) {
+		for (i = 0; i < LION_S; i++)
+			if (p->pieces[i] == (m->to ^ GOTE_PIECE))
+				break;
+
+		assert(i < LION_S);
+		pieces[i] = me->mirror[me->turn[(p->pieces[i] & GOTE_PIECE) ^ (IN_HAND | GOTE_PIECE)]];
+		status &= ~(1 << i);
+	}
+
+	pieces[m->piece] = me->mirror[me->turn[m->to]];
+
+	encode_changed(pc, me, pieces, status);
+}
+
+/*
+ * Encode the position resulting from undoing u on p into pc, where me
+ * has been prepared for p with prepare_encoder().  The result is the
+ * same as that of undo_move() followed by encode_position().
+ */
+extern void
+encode_unmove(poscode *pc, const struct move_encoder *me, const struct position *p,
+    const struct unmove *u)
+{
+	struct position pp;
+	unsigned status = (p->status ^ u->status) & (ROST_S | ROST_G);
+	unsigned char pieces[PIECE_COUNT];
+
+	if (u->piece >= LION_S || me->lionpos == (unsigned char)-1) {
+		pp = *p;
+		undo_move(&pp, u);
+		encode_position(pc, &pp);
+		return;
+	}
+
+	memcpy(pieces, me->pieces, sizeof pieces);
+
+	/* see undo_move() */
+	if (u->capture >= 0)
+		pieces[u->capture] = me->mirror[me->turn[p->pieces[u->piece] ^ GOTE_PIECE]];
+
+	pieces[u->piece] = me->mirror[me->turn[u->from]];
+
+	encode_changed(pc, me, pieces, status);
+}
+
 
 /*
  * Decode a tablebase index (poscode) into a position structure.  It is
@@ -65,6 +287,86 @@ decode_poscode(struct position *pos, const poscode pc)
 	populate_map(pos);
 }
 
+/*
+ * Prepare pd for decoding consecutive poscodes starting with pc and
+ * decode pc into pd->p.  The positions are the same decode_poscode()
+ * yields.
+ */
+extern void
+start_decoder(struct poscode_decoder *pd, poscode pc)
+{
+	const struct cohort_info *chinfo = cohort_info + pc.cohort;
+	unsigned map = pc.map;
+
+	pd->pc = pc;
+	pd->p.status = chinfo->status;
+
+	pd->code[2] = map % chinfo->sizes[2];
+	map /= chinfo->sizes[2];
+	pd->code[1] = map % chinfo->sizes[1];
+	map /= chinfo->sizes[1];
+	pd->code[0] = map; /* % chinfo->sizes[0] */
+
+	place_lions_at(pd);
+	place_kind(pd, 0);
+	place_kind(pd, 1);
+	place_kind(pd, 2);
+}
+
+/*
+ * Advance pd to the next poscode, that is, the next map or, after the
+ * last map, the first map of the next lionpos, and decode it into
+ * pd->p.  Like an odometer, the pieces are only placed anew from the
+ * kind whose placement number changes, so usually only the elephants
+ * move.  pd->pc.lionpos must stay below LIONPOS_TOTAL_COUNT.
+ */
+extern void
+next_poscode(struct poscode_decoder *pd)
+{
+	const struct cohort_info *chinfo = cohort_info + pd->pc.cohort;
+	int i;
+
+	pd->pc.map++;
+	for (i = 2; i >= 0; i--) {
+		if (++pd->code[i] < chinfo->sizes[i])
+			break;
+
+		pd->code[i] = 0;
+	}
+
+	if (i < 0) {
+		pd->pc.map = 0;
+		pd->pc.lionpos++;
+		place_lions_at(pd);
+		i = 0;
+	}
+
+	for (; i < 3; i++)
+		place_kind(pd, i);
+}
+
+/*
+ * Finish encode_move() and encode_unmove() by encoding the position
+ * made of the pieces in pieces with promotion bits status into pc.
+ * The lions must be where they are in me.  pieces is destroyed.
+ */
+static void
+encode_changed(poscode *pc, const struct move_encoder *me, unsigned char pieces[PIECE_COUNT],
+    unsigned status)
+{
+	size_t i;
+
+	pc->ownership = encode_ownership(pieces);
+	pc->lionpos = me->lionpos;
+
+	for (i = 0; i < LION_S; i++)
+		pieces[i] &= ~GOTE_PIECE;
+
+	encode_others(pc, pieces, status, me->keys);
+
+	assert(has_valid_ownership(*pc));
+}
+
 /*
  * Vertically mirror p along the B file.  Do not update p->map.
  */
@@ -72,35 +374,6 @@ static void
 mirror_board(struct position *p)
 {
 	size_t i;
-	static const unsigned char flipped_board[] = {
-		[ 0] = 2,
-		[ 1] = 1,
-		[ 2] = 0,
-		[ 3] = 5,
-		[ 4] = 4,
-		[ 5] = 3,
-		[ 6] = 8,
-		[ 7] = 7,
-		[ 8] = 6,
-		[ 9] = 11,
-		[10] = 10,
-		[11] = 9,
-		[IN_HAND] = IN_HAND,
-
-		[GOTE_PIECE | 0] = GOTE_PIECE | 2,
-		[GOTE_PIECE | 1] = GOTE_PIECE | 1,
-		[GOTE_PIECE | 2] = GOTE_PIECE | 0,
-		[GOTE_PIECE | 3] = GOTE_PIECE | 5,
-		[GOTE_PIECE | 4] = GOTE_PIECE | 4,
-		[GOTE_PIECE | 5] = GOTE_PIECE | 3,
-		[GOTE_PIECE | 6] = GOTE_PIECE | 8,
-		[GOTE_PIECE | 7] = GOTE_PIECE | 7,
-		[GOTE_PIECE | 8] = GOTE_PIECE | 6,
-		[GOTE_PIECE | 9] = GOTE_PIECE | 11,
-		[GOTE_PIECE |10] = GOTE_PIECE | 10,
-		[GOTE_PIECE |11] = GOTE_PIECE | 9,
-		[GOTE_PIECE |IN_HAND] = GOTE_PIECE | IN_HAND,
-	};
 
 	for (i = 0; i < PIECE_COUNT; i++)
 		p->pieces[i] = flipped_board[p->pieces[i]];
@@ -116,36 +389,6 @@ turn_board(struct position *p)
 	size_t i;
 	unsigned char tmp;
 
-	static unsigned char turned_board[] = {
-		[ 0] = GOTE_PIECE | 11,
-		[ 1] = GOTE_PIECE | 10,
-		[ 2] = GOTE_PIECE |  9,
-		[ 3] = GOTE_PIECE |  8,
-		[ 4] = GOTE_PIECE |  7,
-		[ 5] = GOTE_PIECE |  6,
-		[ 6] = GOTE_PIECE |  5,
-		[ 7] = GOTE_PIECE |  4,
-		[ 8] = GOTE_PIECE |  3,
-		[ 9] = GOTE_PIECE |  2,
-		[10] = GOTE_PIECE |  1,
-		[11] = GOTE_PIECE |  0,
-		[IN_HAND] = GOTE_PIECE | IN_HAND,
-
-		[GOTE_PIECE |  0] = 11,
-		[GOTE_PIECE |  1] = 10,
-		[GOTE_PIECE |  2] =  9,
-		[GOTE_PIECE |  3] =  8,
-		[GOTE_PIECE |  4] =  7,
-		[GOTE_PIECE |  5] =  6,
-		[GOTE_PIECE |  6] =  5,
-		[GOTE_PIECE |  7] =  4,
-		[GOTE_PIECE |  8] =  3,
-		[GOTE_PIECE |  9] =  2,
-		[GOTE_PIECE | 10] =  1,
-		[GOTE_PIECE | 11] =  0,
-		[GOTE_PIECE | IN_HAND] = IN_HAND,
-	};
-
 	for (i = 0; i < PIECE_COUNT; i++)
 		p->pieces[i] = turned_board[p->pieces[i]];
 
@@ -179,21 +422,21 @@ normalize_position(struct position *p)
  * Encode who owns what piece into a bitmap between 0 and 64.
  */
 static unsigned
-encode_ownership(const struct position *p)
+encode_ownership(const unsigned char pieces[PIECE_COUNT])
 {
 	unsigned result = 0;
 
-	if (gote_owns(p->pieces[CHCK_S]))
+	if (gote_owns(pieces[CHCK_S]))
 		result |= 1 << 0;
-	if (gote_owns(p->pieces[CHCK_G]))
+	if (gote_owns(pieces[CHCK_G]))
 		result |= 1 << 1;
-	if (gote_owns(p->pieces[GIRA_S]))
+	if (gote_owns(pieces[GIRA_S]))
 		result |= 1 << 2;
-	if (gote_owns(p->pieces[GIRA_G]))
+	if (gote_owns(pieces[GIRA_G]))
 		result |= 1 << 3;
-	if (gote_owns(p->pieces[ELPH_S]))
+	if (gote_owns(pieces[ELPH_S]))
 		result |= 1 << 4;
-	if (gote_owns(p->pieces[ELPH_G]))
+	if (gote_owns(pieces[ELPH_G]))
 		result |= 1 << 5;
 
 	return (result);
@@ -650,8 +893,20 @@ static const unsigned char pair_map[SQUARE_COUNT - 2] = {
  * The idea is to keep an array of empty squares in board_map.  Each time
  * we place a piece on a square we remove that square from board_map by
  * swapping it with the last piece in board_map and then decrementing the
- * number of squares.  This is done with the auxillary function
- * remove_square implemented below.
+ * number of squares.  The squares of each step are removed highest
+ * index first.
+ *
+ * Instead of carrying out these removals, we look up their outcome in
+ * tables generated by mkpostab.  We represent the state of board_map
+ * by the keys of the squares we still need to encode, a key being the
+ * square's index in board_map plus one, or 0 for a piece in hand.
+ * lion_keys holds the keys of all squares after removing the lions.
+ * With the keys hi >= lo of the pieces of one kind, piece_rank gives
+ * the number describing their position and piece_choices the number
+ * of possibilities.  Removing their squares turns each remaining key
+ * into another one, as described by the nibbles of piece_remap.  This
+ * way, encoding does not branch on how many pieces of each kind are
+ * on the board.
  *
  * At the same time, we also try to figure out what cohort this position
  * is in.  This is done by tracking the number of pieces of each kind in
@@ -661,110 +916,93 @@ static const unsigned char pair_map[SQUARE_COUNT - 2] = {
  * normalize their ownership by swapping them if needed.  This is done in
  * the oswap variable.
  */
-static void remove_square(unsigned char*, unsigned char*, unsigned, unsigned);
-
 static void
 encode_pieces(poscode *pc, struct position *p)
 {
-	unsigned code = 0, i, squares = SQUARE_COUNT, high, low;
-	unsigned oswap = 0, cohortbits = 0;
-
-	unsigned char board_map[SQUARE_COUNT] = {
-		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
-	}, inverse_map[SQUARE_COUNT] = {
-		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
-	};
+	unsigned long long keys;
+	unsigned i;
 
 	/* erase ownership information, leaving square numbers */
 	for (i = 0; i < PIECE_COUNT; i++)
 		p->pieces[i] &= ~GOTE_PIECE;
 
-	pc->lionpos = lionpos_map[p->pieces[LION_S]][p->pieces[LION_G] - 3];
+	pc->lionpos = place_lions(&keys, p->pieces[LION_S], p->pieces[LION_G]);
 	assert(pc->lionpos != 0xff);
 
-	if (p->pieces[LION_S] > p->pieces[LION_G]) {
-		remove_square(board_map, inverse_map, --squares, p->pieces[LION_S]);
-		remove_square(board_map, inverse_map, --squares, p->pieces[LION_G]);
-	} else {
-		remove_square(board_map, inverse_map, --squares, p->pieces[LION_G]);
-		remove_square(board_map, inverse_map, --squares, p->pieces[LION_S]);
-	}
+	encode_others(pc, p->pieces, p->status, keys);
+}
+
+/*
+ * Look up the lion position code for Sente's lion on square
+ * sente_lion and Gote's lion on square gote_lion and store the keys of
+ * the remaining squares in keys.  This is the first step of
+ * encode_pieces().
+ */
+static inline unsigned
+place_lions(unsigned long long *keys, unsigned sente_lion, unsigned gote_lion)
+{
+
+	*keys = lion_keys[sente_lion][gote_lion];
+
+	return (lionpos_map[sente_lion][gote_lion - 3]);
+}
+
+/*
+ * Encode the pieces other than the lions as the second step of
+ * encode_pieces().  p holds the square of each piece without
+ * ownership information, which must have been stored in pc->ownership.
+ * status holds the promotion bits.  keys holds the keys of the squares
+ * left after placing the lions.
+ */
+static inline void
+encode_others(poscode *pc, const unsigned char p[PIECE_COUNT], unsigned status,
+    unsigned long long keys)
+{
+	unsigned long long remap;
+	unsigned code = 0, i, j, squares = FIRST_SQUARES, hi, lo, bits, swap;
+	unsigned oswap = 0, cohortbits = 0;
+	unsigned char key[LION_S];
+
+	for (i = 0; i < LION_S; i++)
+		key[i] = keys >> 4 * p[i] & 0xf;
+
+	for (i = 0; i < LION_S; i += 2) {
+		hi = key[i] > key[i + 1] ? key[i] : key[i + 1];
+		lo = key[i] > key[i + 1] ? key[i + 1] : key[i];
+		bits = (hi != 0) | (lo != 0) << 1;
+
+		code = code * piece_choices[squares][bits] + piece_rank[hi][lo];
+		cohortbits |= bits << i;
+
+		/*
+		 * swap if the second piece is the high one or if both are
+		 * in hand and their ownership needs to be normalized.
+		 */
+		swap = (key[i] < key[i + 1]) | ((hi == 0) & ((pc->ownership >> i & 3) == 2));
+		oswap |= -swap & 3 << i;
+
+		/* the elephants are the last kind and need no remap */
+		if (i + 2 < LION_S) {
+			remap = piece_remap[squares - LAST_SQUARES][hi][lo];
+			for (j = i + 2; j < LION_S; j++)
+				key[j] = remap >> 4 * key[j] & 0xf;
+		}
 
-	for (i = 0; i < 6; i += 2)
-		if (p->pieces[i + 1] == IN_HAND)
-			/* no piece to encode but normalize ownership */
-			if (p->pieces[i] == IN_HAND) {
-				if ((pc->ownership & 3 << i) == 2U << i)
-					oswap |= 3 << i;
-			} else {
-				/* encode one piece, no swap */
-				cohortbits |= 1 << i;
-				code = code * squares + inverse_map[p->pieces[i]];
-				remove_square(board_map, inverse_map, --squares, p->pieces[i]);
-			}
-		else
-			if (p->pieces[i] == IN_HAND) {
-				/* encode one piece, swap */
-				oswap |= 3 << i;
-
-				cohortbits |= 1 << i;
-				code = code * squares + inverse_map[p->pieces[i + 1]];
-				remove_square(board_map, inverse_map, --squares, p->pieces[i + 1]);
-			} else {
-				/* encode two pieces */
-				cohortbits |= 3 << i;
-				high = inverse_map[p->pieces[i]];
-				low  = inverse_map[p->pieces[i + 1]];
-
-				/* need swap? */
-				if (high < low) {
-					oswap |= 3 << i;
-
-					unsigned tmp = high;
-					high = low;
-					low = tmp;
-				}
-
-				code = code * pair_map[squares - 1] + pair_map[high - 1] + low;
-				remove_square(board_map, inverse_map, --squares, high);
-				remove_square(board_map, inverse_map, --squares, low);
-			}
+		squares -= (hi != 0) + (lo != 0);
+	}
 
 	/* fix ownership and promotion bits */
 	pc->ownership ^= oswap & owner_flip[pc->ownership];
-	if (oswap & 3)
-		p->status = prom_flip[p->status];
+	status = oswap & 3 ? prom_flip[status] : status;
 
 	/* look up cohort */
-	cohortbits |= p->status << 6;
+	cohortbits |= status << 6;
 	pc->cohort = cohort_map[cohortbits];
 	assert(pc->cohort != (unsigned char)-1);
 
 	pc->map = code;
 }
 
-/*
- * swap the square of the piece pc with the last square on the board with the
- * board where n is the last square on the board. This operation is
- * naively
- *
- *    sq = inverse_map[pc],
- *    swap inverse_map[board_map[sq]] and inverse_map[board_map[n]]
- *    swap board_map[sq] and board_map[n];
- *
- * but we can optimize this procedure by realizing that both board_map[n]
- * and inverse_map[pc] are never read again allowing us to skip
- * assigning to them.
- */
-static void
-remove_square(unsigned char *board_map, unsigned char *inverse_map, unsigned n, unsigned pc)
-{
-	unsigned sq = inverse_map[pc];
-
-	inverse_map[board_map[n]] = sq;
-	board_map[sq] = board_map[n];
-}
-
 /*
  * This function takes a cohort and a piece map into the cohort and
  * decodes the pieces encoded in there into p.  The order of pieces
@@ -832,6 +1070,96 @@ place_pieces(struct position *p, unsigned cohort, unsigned lionpos, unsigned map
 	p->status = chinfo->status;
 }
 
+/*
+ * Place the lions as given by pd->pc.lionpos and prepare the list of
+ * remaining squares for placing the chicks.  See place_pieces().
+ */
+static void
+place_lions_at(struct poscode_decoder *pd)
+{
+	unsigned char *board_map = pd->board_map[0];
+	unsigned i, squares = SQUARE_COUNT, high, low;
+
+	for (i = 0; i < SQUARE_COUNT; i++)
+		board_map[i] = i;
+
+	pd->p.pieces[LION_S] = high = lionpos_inverse[pd->pc.lionpos][0];
+	pd->p.pieces[LION_G] = GOTE_PIECE | (low = lionpos_inverse[pd->pc.lionpos][1]);
+
+	if (high > low) {
+		board_map[high] = board_map[--squares];
+		board_map[low] = board_map[--squares];
+	} else {
+		board_map[low] = board_map[--squares];
+		board_map[high] = board_map[--squares];
+	}
+
+	pd->squares[0] = squares;
+	pd->map[0] = (1 << pd->p.pieces[LION_S] | 1 << pd->p.pieces[LION_G]) & BOARD;
+}
+
+/*
+ * Place the pieces of kind (0: chicks, 1: giraffes, 2: elephants)
+ * as given by pd->code[kind] on the squares left by the previous kinds.
+ * Unless this is the last kind, prepare the squares left for the next
+ * kind.  Otherwise, fill in pd->p.map.  See place_pieces().
+ */
+static void
+place_kind(struct poscode_decoder *pd, unsigned kind)
+{
+	const struct cohort_info *chinfo = cohort_info + pd->pc.cohort;
+	unsigned char *board_map = pd->board_map[kind], *pieces = pd->p.pieces + 2 * kind;
+	unsigned code = pd->code[kind], squares = pd->squares[kind], high = 0, low = 0;
+	unsigned ownership = pd->pc.ownership >> 2 * kind;
+
+	switch (chinfo->pieces[kind]) {
+	case 0:
+		pieces[0] = IN_HAND;
+		pieces[1] = IN_HAND;
+		break;
+
+	case 1:
+		high = code;
+		pieces[0] = board_map[high];
+		pieces[1] = IN_HAND;
+		break;
+
+	case 2:
+		high = pair_inverse[code] + 1;
+		low = code - pair_map[high - 1];
+		assert(high > low);
+
+		pieces[0] = board_map[high];
+		pieces[1] = board_map[low];
+		break;
+
+	default:
+		/* UNREACHABLE */
+		assert(chinfo->pieces[kind] <= 2);
+	}
+
+	if (ownership & 1 << 0)
+		pieces[0] |= GOTE_PIECE;
+	if (ownership & 1 << 1)
+		pieces[1] |= GOTE_PIECE;
+
+	if (kind == 2) {
+		pd->p.map = (pd->map[2] | 1 << pieces[0] | 1 << pieces[1]) & BOARD;
+		return;
+	}
+
+	pd->map[kind + 1] = (pd->map[kind] | 1 << pieces[0] | 1 << pieces[1]) & BOARD;
+
+	memcpy(pd->board_map[kind + 1], board_map, squares);
+	board_map = pd->board_map[kind + 1];
+	if (chinfo->pieces[kind] >= 1)
+		board_map[high] = board_map[--squares];
+	if (chinfo->pieces[kind] == 2)
+		board_map[low] = board_map[--squares];
+
+	pd->squares[kind + 1] = squares;
+}
+
 /*
  * If the position p can be mirrored such that the result has a
  * different poscode than the original, mirror p and return nonzero.
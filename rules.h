@@ -166,6 +166,7 @@ static inline	void	null_move(struct position*);
 
 /* move generation */
 extern		size_t	generate_moves(struct move[MAX_MOVES], const struct position*);
+extern		size_t	generate_legal_moves(struct move[MAX_MOVES], const struct position*);
 extern		size_t	generate_unmoves(struct unmove[MAX_UNMOVES], const struct position*);
 
 /* display */
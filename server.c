@@ -0,0 +1,705 @@
+/*-
+ * Copyright (c) 2016--2017 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "tablebase.h"
+
+/*
+ * This file implements a non-interactive probe server.  The server
+ * reads requests of the form
+ *
+ *     command position
+ *
+ * one per line and writes exactly one line of response per request, in
+ * the order the requests were received.  command is one of
+ *
+ *  - eval      print the evaluation of position, e.g. "#-78" or "0",
+ *              or "win" or "loss" if the distance is unknown
+ *  - lines     print each move with its evaluation, separated by
+ *              spaces, e.g. "Gc4-c3:#-78 Cb3xb2:#-76"
+ *  - bestmove  print the best move or "none" if there is none
+ *
+ * Requests that cannot be served are answered with a line beginning
+ * with "error".  Empty lines are ignored.  Clients may send any number
+ * of requests without waiting for the responses.
+ *
+ * On standard input, all requests received in one read are processed
+ * in parallel by a pool of worker threads.  On a Unix domain socket,
+ * each worker thread accepts connections and serves one client at a
+ * time.  In both cases, all threads share the same tablebase.
+ */
+
+enum {
+	/* the longest request line accepted */
+	MAX_REQUEST = 64,
+
+	/* long enough for the response to a lines request */
+	MAX_RESPONSE = MAX_MOVES * (MAX_MOVSTR + 8) + 1,
+
+	/* the most requests processed in one batch */
+	SERVER_BATCH = 512,
+
+	/* size of the input buffer */
+	SERVER_BUFSIZE = SERVER_BATCH * MAX_REQUEST,
+};
+
+/*
+ * A connection to a client.  buf holds len bytes of input of which the
+ * first off have been processed already.  discard is set while the
+ * remainder of an overlong request line is being skipped.
+ */
+struct connection {
+	int infd, outfd;
+	size_t off, len;
+	int discard;
+	char buf[SERVER_BUFSIZE];
+};
+
+/*
+ * A batch of requests from a stdin connection.  request[i] is answered
+ * in response[i].  Worker threads take requests by incrementing next
+ * and increment done when finished.  The thread that completes the
+ * batch signals batch_done.  generation is incremented whenever a new
+ * batch is posted; a negative count asks the workers to exit.
+ */
+struct server_state {
+	const struct tablebase *tb;
+	pthread_mutex_t lock;
+	pthread_cond_t batch_posted, batch_done;
+	unsigned long generation;
+	size_t next, done;
+	ptrdiff_t count;
+	char *request[SERVER_BATCH];
+	char response[SERVER_BATCH][MAX_RESPONSE];
+};
+
+/*
+ * State shared by the threads accepting connections on a socket.
+ */
+struct socket_state {
+	const struct tablebase *tb;
+	int listenfd;
+};
+
+static int	 read_requests(struct connection *, char *[SERVER_BATCH], size_t *);
+static int	 write_fully(int, const char *, size_t);
+static void	 serve_request(char[MAX_RESPONSE], const struct tablebase *, char *);
+static void	 serve_eval(char[MAX_RESPONSE], const struct tablebase *, const struct position *);
+static void	 serve_lines(char[MAX_RESPONSE], const struct tablebase *, const struct position *);
+static void	 serve_bestmove(char[MAX_RESPONSE], const struct tablebase *, const struct position *);
+static size_t	 render_entry(char *, size_t, tb_entry);
+static void	 run_batch(struct server_state *);
+static void	*batch_worker(void *);
+static void	*socket_worker(void *);
+static void	 serve_connection(const struct tablebase *, int, int);
+static int	 remove_stale_socket(const struct sockaddr_un *);
+static void	 remove_socket(int);
+
+/*
+ * Serve requests read from infd, writing responses to outfd until the
+ * end of input is reached, using threads worker threads.  Return 0
+ * when the end of input has been reached, -1 on error with errno set.
+ */
+extern int
+serve_stream(const struct tablebase *tb, int infd, int outfd, int threads)
+{
+	struct server_state *ss;
+	struct connection *conn;
+	pthread_t pool[SERVER_MAX_THREADS - 1];
+	size_t i, n;
+	int error, result, saved_errno, nthread;
+
+	if (threads < 1 || threads > SERVER_MAX_THREADS) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	ss = malloc(sizeof *ss);
+	if (ss == NULL)
+		return (-1);
+
+	conn = malloc(sizeof *conn);
+	if (conn == NULL) {
+		saved_errno = errno;
+		free(ss);
+		errno = saved_errno;
+		return (-1);
+	}
+
+	conn->infd = infd;
+	conn->outfd = outfd;
+	conn->off = 0;
+	conn->len = 0;
+	conn->discard = 0;
+
+	ss->tb = tb;
+	ss->generation = 0;
+	ss->next = 0;
+	ss->done = 0;
+	ss->count = 0;
+
+	error = pthread_mutex_init(&ss->lock, NULL);
+	if (error != 0)
+		goto fail_alloc;
+
+	error = pthread_cond_init(&ss->batch_posted, NULL);
+	if (error != 0)
+		goto fail_lock;
+
+	error = pthread_cond_init(&ss->batch_done, NULL);
+	if (error != 0)
+		goto fail_posted;
+
+	/* the calling thread works on each batch, too */
+	for (nthread = 0; nthread < threads - 1; nthread++) {
+		error = pthread_create(pool + nthread, NULL, batch_worker, ss);
+		if (error != 0)
+			break;
+	}
+
+	while (result = read_requests(conn, ss->request, &n), result == 0 && n > 0) {
+		pthread_mutex_lock(&ss->lock);
+		ss->count = n;
+		ss->next = 0;
+		ss->done = 0;
+		ss->generation++;
+		pthread_cond_broadcast(&ss->batch_posted);
+		pthread_mutex_unlock(&ss->lock);
+
+		run_batch(ss);
+
+		pthread_mutex_lock(&ss->lock);
+		while (ss->done < n)
+			pthread_cond_wait(&ss->batch_done, &ss->lock);
+
+		pthread_mutex_unlock(&ss->lock);
+
+		for (i = 0; i < n; i++)
+			if (write_fully(outfd, ss->response[i], strlen(ss->response[i])) != 0) {
+				result = -1;
+				goto done;
+			}
+	}
+
+done:
+	saved_errno = errno;
+
+	pthread_mutex_lock(&ss->lock);
+	ss->count = -1;
+	ss->generation++;
+	pthread_cond_broadcast(&ss->batch_posted);
+	pthread_mutex_unlock(&ss->lock);
+
+	for (i = 0; i < (size_t)nthread; i++)
+		pthread_join(pool[i], NULL);
+
+	pthread_cond_destroy(&ss->batch_done);
+	pthread_cond_destroy(&ss->batch_posted);
+	pthread_mutex_destroy(&ss->lock);
+	free(conn);
+	free(ss);
+
+	errno = saved_errno;
+	return (result);
+
+fail_posted:
+	pthread_cond_destroy(&ss->batch_posted);
+fail_lock:
+	pthread_mutex_destroy(&ss->lock);
+fail_alloc:
+	free(conn);
+	free(ss);
+	errno = error;
+	return (-1);
+}
+
+/*
+ * The socket serve_socket() listens on, removed by remove_socket().
+ */
+static const char *socket_path = NULL;
+
+/*
+ * Listen for connections on the Unix domain socket path and serve
+ * them with threads worker threads.  If path is a socket no server
+ * listens on anymore, it is replaced.  The socket is removed when the
+ * server is terminated by SIGINT, SIGTERM or SIGHUP.  This function
+ * only returns on error, returning -1 with errno set.
+ */
+extern int
+serve_socket(const struct tablebase *tb, const char *path, int threads)
+{
+	struct socket_state sks;
+	struct sockaddr_un sun;
+	pthread_t pool[SERVER_MAX_THREADS];
+	int i, error;
+
+	if (threads < 1 || threads > SERVER_MAX_THREADS
+	    || strlen(path) >= sizeof sun.sun_path) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/* a client going away must not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	if (remove_stale_socket(&sun) != 0)
+		return (-1);
+
+	sks.tb = tb;
+	sks.listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sks.listenfd == -1)
+		return (-1);
+
+	if (bind(sks.listenfd, (struct sockaddr *)&sun, sizeof sun) != 0) {
+		error = errno;
+		close(sks.listenfd);
+		errno = error;
+		return (-1);
+	}
+
+	socket_path = path;
+	signal(SIGINT, remove_socket);
+	signal(SIGTERM, remove_socket);
+	signal(SIGHUP, remove_socket);
+
+	if (listen(sks.listenfd, SOMAXCONN) != 0)
+		goto fail;
+
+	for (i = 0; i < threads; i++) {
+		error = pthread_create(pool + i, NULL, socket_worker, &sks);
+		if (error != 0) {
+			errno = error;
+			break;
+		}
+	}
+
+	/* if we couldn't create a single thread, give up */
+	if (i == 0)
+		goto fail;
+
+	/* socket workers only return when accept() fails */
+	while (i > 0)
+		pthread_join(pool[--i], NULL);
+
+fail:
+	error = errno;
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	close(sks.listenfd);
+	unlink(path);
+	errno = error;
+
+	return (-1);
+}
+
+/*
+ * If a socket exists at the address sun but no server accepts
+ * connections on it, remove it so it can be bound again.  Anything
+ * else is left in place for bind() to fail on.  Return 0 on success,
+ * -1 with errno set on failure.
+ */
+static int
+remove_stale_socket(const struct sockaddr_un *sun)
+{
+	struct stat st;
+	int fd, stale;
+
+	if (lstat(sun->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode))
+		return (0);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return (-1);
+
+	stale = connect(fd, (const struct sockaddr *)sun, sizeof *sun) != 0 && errno == ECONNREFUSED;
+	close(fd);
+
+	if (stale && unlink(sun->sun_path) != 0)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Signal handler removing the socket the server listens on before
+ * terminating the process with signal sig as if it wasn't caught.
+ */
+static void
+remove_socket(int sig)
+{
+
+	unlink(socket_path);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/*
+ * Process requests from the current batch until none are left.
+ */
+static void
+run_batch(struct server_state *ss)
+{
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&ss->lock);
+		if (ss->count < 0 || ss->next >= (size_t)ss->count) {
+			pthread_mutex_unlock(&ss->lock);
+			return;
+		}
+
+		i = ss->next++;
+		pthread_mutex_unlock(&ss->lock);
+
+		serve_request(ss->response[i], ss->tb, ss->request[i]);
+
+		pthread_mutex_lock(&ss->lock);
+		if (++ss->done == (size_t)ss->count)
+			pthread_cond_signal(&ss->batch_done);
+
+		pthread_mutex_unlock(&ss->lock);
+	}
+}
+
+/*
+ * Wait for batches to be posted and help processing them until asked
+ * to exit.
+ */
+static void *
+batch_worker(void *ssarg)
+{
+	struct server_state *ss = ssarg;
+	unsigned long generation = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&ss->lock);
+		while (ss->generation == generation)
+			pthread_cond_wait(&ss->batch_posted, &ss->lock);
+
+		generation = ss->generation;
+		if (ss->count < 0) {
+			pthread_mutex_unlock(&ss->lock);
+			return (NULL);
+		}
+
+		pthread_mutex_unlock(&ss->lock);
+
+		run_batch(ss);
+	}
+}
+
+/*
+ * Accept connections on the listening socket and serve them until
+ * accept() fails.
+ */
+static void *
+socket_worker(void *sksarg)
+{
+	struct socket_state *sks = sksarg;
+	int fd;
+
+	for (;;) {
+		fd = accept(sks->listenfd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			perror("accept");
+			return (NULL);
+		}
+
+		serve_connection(sks->tb, fd, fd);
+		close(fd);
+	}
+}
+
+/*
+ * Serve requests on a single connection in the calling thread until
+ * the client closes the connection or an error occurs.
+ */
+static void
+serve_connection(const struct tablebase *tb, int infd, int outfd)
+{
+	struct connection *conn;
+	char *request[SERVER_BATCH], response[MAX_RESPONSE];
+	size_t i, n;
+
+	conn = malloc(sizeof *conn);
+	if (conn == NULL)
+		return;
+
+	conn->infd = infd;
+	conn->outfd = outfd;
+	conn->off = 0;
+	conn->len = 0;
+	conn->discard = 0;
+
+	while (read_requests(conn, request, &n) == 0 && n > 0)
+		for (i = 0; i < n; i++) {
+			serve_request(response, tb, request[i]);
+			if (write_fully(outfd, response, strlen(response)) != 0)
+				goto done;
+		}
+
+done:
+	free(conn);
+}
+
+/*
+ * Read the next batch of requests from conn.  Block until at least
+ * one complete request is available, then return all complete
+ * requests received so far, up to SERVER_BATCH, in request and their
+ * number in *n.  The newlines terminating the requests are replaced
+ * with NUL bytes; the strings remain valid until the next call.  A
+ * line that is too long is returned as an empty string so that it can
+ * be answered with an error.  At the end of input, *n is set to 0.
+ * Return 0 on success, -1 on error.
+ */
+static int
+read_requests(struct connection *conn, char *request[SERVER_BATCH], size_t *n)
+{
+	ssize_t count;
+	char *line, *newline, *end;
+
+	*n = 0;
+
+	/* move unprocessed data to the beginning of the buffer */
+	memmove(conn->buf, conn->buf + conn->off, conn->len - conn->off);
+	conn->len -= conn->off;
+	conn->off = 0;
+
+	for (;;) {
+		line = conn->buf + conn->off;
+		end = conn->buf + conn->len;
+		while (*n < SERVER_BATCH
+		    && (newline = memchr(line, '\n', end - line)) != NULL) {
+			*newline = '\0';
+			if (conn->discard) {
+				/* tail of an overlong line */
+				conn->discard = 0;
+				*line = '\0';
+				request[(*n)++] = line;
+			} else if (newline - line >= MAX_REQUEST) {
+				*line = '\0';
+				request[(*n)++] = line;
+			} else if (line[strspn(line, " \t\r")] != '\0')
+				request[(*n)++] = line;
+
+			line = newline + 1;
+		}
+
+		conn->off = line - conn->buf;
+		if (*n > 0)
+			return (0);
+
+		/* drop overlong partial lines instead of buffering them */
+		if (conn->len - conn->off >= MAX_REQUEST) {
+			conn->discard = 1;
+			conn->off = conn->len;
+		}
+
+		memmove(conn->buf, conn->buf + conn->off, conn->len - conn->off);
+		conn->len -= conn->off;
+		conn->off = 0;
+
+		count = read(conn->infd, conn->buf + conn->len, SERVER_BUFSIZE - conn->len);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return (-1);
+		}
+
+		if (count == 0)
+			return (0);
+
+		conn->len += count;
+	}
+}
+
+/*
+ * Write exactly len bytes from buf to fd.  Return 0 on success, -1 on
+ * error.
+ */
+static int
+write_fully(int fd, const char *buf, size_t len)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		count = write(fd, buf, len);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return (-1);
+		}
+
+		buf += count;
+		len -= count;
+	}
+
+	return (0);
+}
+
+/*
+ * This table contains all commands the server understands.
+ */
+static const struct {
+	void (*callback)(char[MAX_RESPONSE], const struct tablebase *, const struct position *);
+	char command[9];
+} server_commands[] = {
+	{ serve_bestmove,	"bestmove" },
+	{ serve_eval,		"eval" },
+	{ serve_lines,		"lines" },
+	{ NULL,			"" },
+};
+
+/*
+ * Parse request and place the newline-terminated response into
+ * response.  request is modified in the process.
+ */
+static void
+serve_request(char response[MAX_RESPONSE], const struct tablebase *tb, char *request)
+{
+	struct position p;
+	size_t i, len;
+	char *cmd, *arg, *end;
+
+	if (request[0] == '\0') {
+		strcpy(response, "error request too long\n");
+		return;
+	}
+
+	cmd = request + strspn(request, " \t");
+	len = strcspn(cmd, " \t\r");
+	arg = cmd + len;
+	arg += strspn(arg, " \t");
+	end = arg + strcspn(arg, " \t\r");
+	end += strspn(end, " \t\r");
+	arg[strcspn(arg, " \t\r")] = '\0';
+	cmd[len] = '\0';
+
+	for (i = 0; server_commands[i].callback != NULL; i++)
+		if (strcmp(cmd, server_commands[i].command) == 0)
+			break;
+
+	if (server_commands[i].callback == NULL)
+		strcpy(response, "error unknown command\n");
+	else if (*end != '\0')
+		strcpy(response, "error trailing characters after position\n");
+	else if (strlen(arg) >= MAX_POSSTR || parse_position(&p, arg) != 0)
+		strcpy(response, "error invalid position\n");
+	else if (tb == NULL)
+		strcpy(response, "error tablebase unavailable\n");
+	else
+		server_commands[i].callback(response, tb, &p);
+}
+
+/*
+ * Render e into buf like the show eval command does.  Return the
+ * number of characters written, not including the terminating NUL.
+ */
+static size_t
+render_entry(char *buf, size_t size, tb_entry e)
+{
+
+	if (is_draw(e))
+		return (snprintf(buf, size, "0"));
+	else if (!has_dtm(e))
+		return (snprintf(buf, size, is_win(e) ? "win" : "loss"));
+	else
+		return (snprintf(buf, size, is_win(e) ? "#%d" : "#-%d", get_dtm(e)));
+}
+
+/*
+ * Answer an eval request.
+ */
+static void
+serve_eval(char response[MAX_RESPONSE], const struct tablebase *tb, const struct position *p)
+{
+	size_t len;
+
+	len = render_entry(response, MAX_RESPONSE - 1, lookup_position(tb, p));
+	strcpy(response + len, "\n");
+}
+
+/*
+ * Answer a lines request.  The moves are ordered from best to worst.
+ */
+static void
+serve_lines(char response[MAX_RESPONSE], const struct tablebase *tb, const struct position *p)
+{
+	struct analysis analysis[MAX_MOVES];
+	size_t i, nmove, len = 0;
+	char movstr[MAX_MOVSTR];
+
+	nmove = analyze_position(analysis, tb, p, MAX_STRENGTH);
+	for (i = 0; i < nmove; i++) {
+		move_string(movstr, p, &analysis[i].move);
+		len += snprintf(response + len, MAX_RESPONSE - len, "%s%s:",
+		    i == 0 ? "" : " ", movstr);
+		len += render_entry(response + len, MAX_RESPONSE - len, analysis[i].entry);
+	}
+
+	strcpy(response + len, "\n");
+}
+
+/*
+ * Answer a bestmove request.  Unlike ai_move(), this always picks the
+ * first of the best moves so the answer is deterministic.
+ */
+static void
+serve_bestmove(char response[MAX_RESPONSE], const struct tablebase *tb, const struct position *p)
+{
+	struct analysis analysis[MAX_MOVES];
+	size_t nmove;
+	char movstr[MAX_MOVSTR];
+
+	nmove = analyze_position(analysis, tb, p, MAX_STRENGTH);
+	if (nmove == 0) {
+		strcpy(response, "none\n");
+		return;
+	}
+
+	move_string(movstr, p, &analysis[0].move);
+	snprintf(response, MAX_RESPONSE, "%s\n", movstr);
+}
@@ -90,6 +90,12 @@ enum {
 	GENTB_MAX_THREADS = 64,
 #endif
 
+	/*
+	 * The maximum number of threads allowed for serve_stream() and
+	 * serve_socket().
+	 */
+	SERVER_MAX_THREADS = 64,
+
 	/*
 	 * The last parameter to ai_move() indicates the ai strength,
 	 * which should be an integer between 0 and MAX_STRENGTH.  This
@@ -97,15 +103,118 @@ enum {
 	 * floating point overflow happens during computation.
 	 */
 	MAX_STRENGTH = 700,
+
+	/*
+	 * A tablebase may only record whether positions are won, drawn,
+	 * or lost, see write_wdl_tablebase().  Won and lost positions
+	 * from such a tablebase are reported as WDL_DISTANCE and
+	 * -WDL_DISTANCE, which is longer than any actual distance to
+	 * mate.  Use has_dtm() to tell these apart.
+	 */
+	WDL_DISTANCE = 100,
+};
+
+/*
+ * Flags for read_tablebase().  Uncompressed tablebases are mapped into
+ * memory instead of being read where possible, allowing multiple
+ * processes to share one copy of the tablebase.  TB_WILLNEED advises
+ * the system to page in the whole mapping ahead of time.  TB_HUGEPAGE
+ * asks for huge pages to back the tablebase, reducing TLB misses on
+ * lookups.  As file mappings can rarely be backed by huge pages, an
+ * uncompressed tablebase is read into memory instead of being mapped
+ * if TB_HUGEPAGE is given.  tablebase_pages() reports what was
+ * obtained.
+ * TB_ONDEMAND causes a compressed tablebase to be decompressed piece
+ * by piece as positions are looked up instead of all at once.  Each
+ * piece is checked as it is decompressed.  If one turns out to be
+ * corrupt or cannot be read, the lookup aborts the program.
+ * TB_VERIFY checks the checksum of a mapped tablebase or one loaded on
+ * demand, too, which means reading or decompressing all of it.
+ * Tablebases read into memory are always checked.  All flags are hints
+ * and are ignored if not applicable.
+ */
+enum {
+	TB_WILLNEED = 1 << 0,
+	TB_HUGEPAGE = 1 << 1,
+	TB_ONDEMAND = 1 << 2,
+	TB_VERIFY = 1 << 3,
+};
+
+/*
+ * Options for generate_tablebase().  threads is the number of threads
+ * used to generate the tablebase.  If checkpoint is not NULL, the state
+ * of the generator is saved to the file it names after a round has
+ * finished if at least checkpoint_interval seconds have passed since
+ * the last checkpoint was written.  If resume is not NULL, generation
+ * continues from the checkpoint file it names.  If max_rounds is not
+ * zero, generation stops after that many rounds, leaving an incomplete
+ * tablebase.  This is useful for benchmarking.  If telemetry is not
+ * NULL, statistics about each round are written to it as one line of
+ * JSON per round.  flags may contain TB_HUGEPAGE to back the tablebase
+ * with huge pages during generation.  algorithm selects how positions
+ * are found to be won or lost, see below.  If workdir is not NULL, the
+ * tablebase is generated out of core with the counter algorithm,
+ * keeping it in scratch files in the directory workdir and holding
+ * only partitions of about partition_size positions in memory at a
+ * time.  This mode requires threads to be 1 and algorithm to be
+ * GENTB_COUNTER and supports neither checkpoints, telemetry, huge
+ * pages, pin nor placement; generate_tablebase() fails with EINVAL if
+ * any of them is requested.  If pin is set, each thread is pinned to
+ * a CPU of its own.  placement selects on which NUMA nodes the memory
+ * of the tablebase under construction is placed, see below.
+ * Placement other than GENTB_PLACE_DEFAULT implies pin.
+ */
+struct gentb_options {
+	int threads, flags, algorithm, pin, placement;
+	unsigned checkpoint_interval, max_rounds;
+	size_t partition_size;
+	const char *checkpoint, *resume, *workdir;
+	FILE *telemetry;
+};
+
+/*
+ * Algorithms for generate_tablebase().  GENTB_RETROGRADE works
+ * backwards from the positions decided in the previous round, finding
+ * their predecessors with generate_unmoves().  GENTB_FORWARD sweeps
+ * over all undecided positions each round, looking only at their
+ * successors.  GENTB_COUNTER works like GENTB_RETROGRADE but keeps
+ * a count of the moves not yet found to be losing for each position,
+ * saving the verification of candidate losses at the cost of another
+ * byte of memory per position.  All produce the same tablebase.
+ */
+enum {
+	GENTB_RETROGRADE = 0,
+	GENTB_FORWARD = 1,
+	GENTB_COUNTER = 2,
+};
+
+/*
+ * Memory placement for generate_tablebase().  With
+ * GENTB_PLACE_DEFAULT, the memory is placed wherever the system
+ * chooses, usually all on the node of the thread allocating it.
+ * GENTB_PLACE_INTERLEAVE spreads it evenly across the threads' nodes
+ * in blocks of 2 MiB.  GENTB_PLACE_LOCAL places the part of the
+ * encoding space each thread is assigned at the beginning of a round
+ * on the thread's node.  This only makes a difference on machines with
+ * more than one NUMA node.
+ */
+enum {
+	GENTB_PLACE_DEFAULT = 0,
+	GENTB_PLACE_INTERLEAVE = 1,
+	GENTB_PLACE_LOCAL = 2,
 };
 
 /* tablebase functionality */
-extern		struct tablebase	*generate_tablebase(int);
-extern		struct tablebase	*read_tablebase(FILE*);
+extern		struct tablebase	*generate_tablebase(const struct gentb_options*);
+extern		struct tablebase	*read_tablebase(FILE*, int);
 extern		tb_entry		 lookup_position(const struct tablebase*, const struct position*);
+extern		void			 lookup_positions(const struct tablebase*, const struct position*,
+					     size_t, tb_entry*);
 extern		int			 write_tablebase(FILE*, const struct tablebase*);
+extern		int			 write_wdl_tablebase(FILE*, const struct tablebase*);
 extern		int			 validate_tablebase(const struct tablebase*);
 extern		void			 free_tablebase(struct tablebase*);
+extern		const char		*tablebase_pages(const struct tablebase*);
 
 /* ai functionality */
 extern		void			 ai_seed(struct seed*);
@@ -114,10 +223,15 @@ extern		struct move		 ai_move(const struct tablebase*, const struct position*,
 extern		size_t			 analyze_position(struct analysis[MAX_MOVES],
 					     const struct tablebase*, const struct position*, double);
 
+/* probe server, see server.c */
+extern		int			 serve_stream(const struct tablebase*, int, int, int);
+extern		int			 serve_socket(const struct tablebase*, const char*, int);
+
 /* auxillary functionality */
 static inline	int			 is_win(tb_entry);
 static inline	int			 is_draw(tb_entry);
 static inline	int			 is_loss(tb_entry);
+static inline	int			 has_dtm(tb_entry);
 static inline	int			 get_dtm(tb_entry);
 static inline	tb_entry		 next_dtm(tb_entry);
 static inline	tb_entry		 prev_dtm(tb_entry);
@@ -145,6 +259,17 @@ is_loss(tb_entry e)
 	return (e < 0);
 }
 
+/*
+ * Return 1 if e carries a distance to mate, 0 if e is a win or loss
+ * of unknown distance from a WDL tablebase.
+ */
+static inline int
+has_dtm(tb_entry e)
+{
+
+	return (e > -WDL_DISTANCE && e < WDL_DISTANCE);
+}
+
 /*
  * Return the distance to mate in half moves.  If e is a draw, the
  * result is unspecified.
@@ -24,13 +24,119 @@
  */
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "xz/xz.h"
 #include "dobutsutable.h"
 
-static int read_xz_tablebase(FILE *f, struct tablebase *tb);
+struct lookup_request;
+
+static int read_uncompressed(FILE *f, struct tablebase *tb, off_t startpos, int flags);
+static int read_compressed(FILE *f, struct tablebase *tb, off_t startpos, int flags);
+static int map_tablebase(FILE *f, struct tablebase *tb, off_t startpos, int flags);
+static int check_crc(const struct tablebase *tb);
+static int check_block_header(struct tablebase *tb, const struct xz_index *index,
+    const unsigned char *first);
+static int read_xz_tablebase(FILE *f, struct tablebase *tb, int flags);
+static int read_xz_blocks(int fd, struct tablebase *tb, struct xz_index *index, int flags);
+static void *xzload_worker(void *);
+static int open_tbcache(int fd, struct tablebase *tb, struct xz_index *index, int flags);
+static void free_tbcache(struct tbcache *cache);
+static struct tbcache_slot *load_block(struct tbcache *cache, size_t block);
+static int check_blocks(struct tbcache *cache, const struct tablebase *tb);
+static int lookup_cached(const struct tablebase *tb, size_t offset);
+static inline tb_entry tb_value(const struct tablebase *tb, size_t offset);
+static inline tb_entry wdl_value(unsigned byte, size_t offset);
+static void lookup_batch(const struct tablebase *tb, const struct position *ps, size_t n,
+    tb_entry *out, struct lookup_request *req);
+static int compare_request(const void *a, const void *b);
+
+/* the first bytes of an xz compressed file */
+static const unsigned char xz_magic[6] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+
+enum {
+	/*
+	 * The number of decompressed blocks held in memory when loading
+	 * a tablebase on demand.  With 1 MiB blocks as set up in the
+	 * Makefile, the cache takes up to 32 MiB.
+	 */
+	TBCACHE_SLOTS = 32,
+
+	/*
+	 * The maximum number of threads used to decompress a tablebase
+	 * made of multiple blocks.  Beyond this point, the disk is
+	 * likely the bottleneck.
+	 */
+	XZLOAD_MAX_THREADS = 64,
+
+	/* number of positions lookup_positions() processes at once */
+	LOOKUP_BATCH = 1024,
+
+	/* how many tablebase accesses ahead lookup_positions() prefetches */
+	LOOKUP_PREFETCH = 8,
+};
+
+/*
+ * A tablebase access to be made by lookup_positions().  offset is the
+ * offset of the entry to read, index the number of the position in
+ * the batch whose value depends on the entry.
+ */
+struct lookup_request {
+	size_t offset, index;
+};
+
+/*
+ * This structure coordinates the threads decompressing a tablebase
+ * made of multiple blocks, see read_xz_blocks().  next is the number
+ * of the next block to decompress, error the first error encountered
+ * or 0 if none was.  Both may only be accessed with lock held.  The
+ * other members are not modified while the threads run.
+ */
+struct xzload_state {
+	pthread_mutex_t lock;
+	size_t next;
+	int error;
+
+	const struct xz_index *index;
+	struct tablebase *tb;
+	int fd;
+};
+
+/*
+ * When the tablebase is loaded on demand (TB_ONDEMAND), the compressed
+ * file is kept open and its blocks are decompressed as they are needed.
+ * The last TBCACHE_SLOTS blocks used are kept in slot.  slot_of maps
+ * block numbers to the slot holding them or -1 if the block is not
+ * cached.  tick counts the blocks loaded and a slot's used member
+ * records the value tick had when the slot was last used.  When a
+ * block must be loaded, the least recently used slot (with the lowest
+ * used value) is evicted.  Lookups of cached blocks only hold lock for
+ * reading so they can proceed in parallel.  They merely update used,
+ * which is why it is atomic.  Everything else may only be modified
+ * with lock held for writing.
+ */
+struct tbcache {
+	pthread_rwlock_t lock;
+	struct xz_index *index;
+	struct xz_dec *xzd;
+	unsigned char *inbuf;
+	int *slot_of;
+	unsigned long long tick;
+	int fd;
+
+	struct tbcache_slot {
+		unsigned char *data;
+		atomic_ullong used;
+		int block;
+	} slot[TBCACHE_SLOTS];
+};
 
 /*
  * Release all storage associated with tb.  The pointer to tb then
@@ -39,9 +145,57 @@ static int read_xz_tablebase(FILE *f, struct tablebase *tb);
 extern void
 free_tablebase(struct tablebase *tb)
 {
+	if (tb == NULL)
+		return;
+
+	free_positions(tb);
+
+	if (tb->cache != NULL)
+		free_tbcache(tb->cache);
+
 	free(tb);
 }
 
+/*
+ * Return the entry at offset in tb.
+ */
+static inline tb_entry
+tb_value(const struct tablebase *tb, size_t offset)
+{
+
+	if (!tb->wdl) {
+		if (tb->positions != NULL)
+			return (tb->positions[offset]);
+		else
+			return ((signed char)lookup_cached(tb, offset));
+	}
+
+	if (tb->positions != NULL)
+		return (wdl_value(((const unsigned char*)tb->positions)[offset / 4], offset));
+	else
+		return (wdl_value(lookup_cached(tb, offset / 4), offset));
+}
+
+/*
+ * Decode the entry at offset in a WDL tablebase from byte, the byte
+ * of the tablebase containing it.
+ */
+static inline tb_entry
+wdl_value(unsigned byte, size_t offset)
+{
+
+	switch (byte >> 2 * (offset % 4) & 3) {
+	case WDL_WIN:
+		return (WDL_DISTANCE);
+
+	case WDL_LOSS:
+		return (-WDL_DISTANCE);
+
+	default:
+		return (0);
+	}
+}
+
 /*
  * Looks up a position in the table base, return its value.
  */
@@ -50,102 +204,383 @@ lookup_position(const struct tablebase *tb, const struct position *p)
 {
 	poscode pc, ppc;
 	struct move moves[MAX_MOVES];
-	struct position pp;
+	struct move_encoder me;
+	struct xposition xp;
 	size_t i, nmove;
 	tb_entry e, worst = 1;
-	int game_ends;
 
 	/* checkmates aren't looked up */
-	if (gote_moves(p) ? sente_in_check(p) : gote_in_check(p))
+	extend_position(&xp, p);
+	if (gote_moves(p) ? xsente_in_check(&xp) : xgote_in_check(&xp))
 		return (1);
 
 	encode_position(&pc, p);
 
 	/* if the position is in the table base, look it up */
 	if (ownership_map[pc.ownership] < OWNERSHIP_COUNT)
-		return (tb->positions[position_offset(pc)]);
+		return (tb_value(tb, position_offset(pc)));
 
-	/* otherwise, compute its value */
-	nmove = generate_moves(moves, p);
+	/*
+	 * otherwise, compute its value.  Moving into check cannot be
+	 * an improval.
+	 */
+	prepare_encoder(&me, p);
+	nmove = xgenerate_legal_moves(moves, &xp);
 	for (i = 0; i < nmove; i++) {
-		pp = *p;
-		game_ends = play_move(&pp, moves + i);
-		assert(!game_ends);
-		(void)game_ends;
-
-		/* moving into check cannot be an improval */
-		if (gote_moves(&pp) ? sente_in_check(&pp) : gote_in_check(&pp))
-			continue;
-
-		encode_position(&ppc, &pp);
+		encode_move(&ppc, &me, p, moves + i);
 		assert(ownership_map[ppc.ownership] < OWNERSHIP_COUNT);
-		e = tb->positions[position_offset(ppc)];
+		e = tb_value(tb, position_offset(ppc));
 		if (wdl_compare(e, worst) < 0)
 			worst = e;
 	}
 
-	return (prev_dtm(worst));
+	/* a loss of unknown distance only yields a win of unknown distance */
+	e = prev_dtm(worst);
+	return (e > WDL_DISTANCE ? WDL_DISTANCE : e);
+}
+
+/*
+ * Look up the n positions in ps and store their values in out.  The
+ * result is the same as calling lookup_position() on each position,
+ * but faster for large n as tablebase accesses are sorted by offset
+ * for better locality and prefetched ahead of use.  Positions outside
+ * of the stored ownership range are evaluated from their successors
+ * as in lookup_position(), the lookups of the successors being sorted
+ * along with all others.
+ */
+extern void
+lookup_positions(const struct tablebase *tb, const struct position *ps, size_t n, tb_entry *out)
+{
+	struct lookup_request *req;
+	size_t i, batch = n < LOOKUP_BATCH ? n : LOOKUP_BATCH;
+
+	req = malloc(batch * MAX_MOVES * sizeof *req);
+	if (req == NULL) {
+		/* do it the slow way */
+		for (i = 0; i < n; i++)
+			out[i] = lookup_position(tb, ps + i);
+
+		return;
+	}
+
+	for (i = 0; i < n; i += batch)
+		lookup_batch(tb, ps + i, n - i < batch ? n - i : batch, out + i, req);
+
+	free(req);
+}
+
+/*
+ * Look up up to LOOKUP_BATCH positions for lookup_positions().  req
+ * must have space for n * MAX_MOVES requests.  First, the tablebase
+ * accesses needed for each position are collected in req.  Then they
+ * are sorted and carried out, combining the values of successors for
+ * positions not in the tablebase.
+ */
+static void
+lookup_batch(const struct tablebase *tb, const struct position *ps, size_t n,
+    tb_entry *out, struct lookup_request *req)
+{
+	poscode pc;
+	struct move moves[MAX_MOVES];
+	struct move_encoder me;
+	struct xposition xp;
+	size_t i, j, nmove, nreq = 0, index;
+	tb_entry e;
+	unsigned char derived[LOOKUP_BATCH];
+
+	for (i = 0; i < n; i++) {
+		derived[i] = 0;
+
+		/* checkmates aren't looked up */
+		extend_position(&xp, ps + i);
+		if (gote_moves(ps + i) ? xsente_in_check(&xp) : xgote_in_check(&xp)) {
+			out[i] = 1;
+			continue;
+		}
+
+		encode_position(&pc, ps + i);
+		if (ownership_map[pc.ownership] < OWNERSHIP_COUNT) {
+			req[nreq].offset = position_offset(pc);
+			req[nreq++].index = i;
+			continue;
+		}
+
+		/*
+		 * otherwise, derive its value from its successors.
+		 * Moving into check cannot be an improval.
+		 */
+		derived[i] = 1;
+		out[i] = 1;
+		prepare_encoder(&me, ps + i);
+		nmove = xgenerate_legal_moves(moves, &xp);
+		for (j = 0; j < nmove; j++) {
+			encode_move(&pc, &me, ps + i, moves + j);
+			assert(ownership_map[pc.ownership] < OWNERSHIP_COUNT);
+			req[nreq].offset = position_offset(pc);
+			req[nreq++].index = i;
+		}
+	}
+
+	qsort(req, nreq, sizeof *req, compare_request);
+
+	for (i = 0; i < nreq; i++) {
+		if (tb->positions != NULL && i + LOOKUP_PREFETCH < nreq)
+			prefetch((const void*)(tb->positions
+			    + (req[i + LOOKUP_PREFETCH].offset >> (tb->wdl ? 2 : 0))));
+
+		e = tb_value(tb, req[i].offset);
+		index = req[i].index;
+		if (!derived[index])
+			out[index] = e;
+		else if (wdl_compare(e, out[index]) < 0)
+			out[index] = e;
+	}
+
+	for (i = 0; i < n; i++)
+		if (derived[i]) {
+			out[i] = prev_dtm(out[i]);
+			if (out[i] > WDL_DISTANCE)
+				out[i] = WDL_DISTANCE;
+		}
+}
+
+/*
+ * Order two struct lookup_request by offset.
+ */
+static int
+compare_request(const void *a, const void *b)
+{
+	const struct lookup_request *ra = a, *rb = b;
+
+	return ((ra->offset > rb->offset) - (ra->offset < rb->offset));
 }
 
 /*
  * Read a tablebase from file f.  It is assumed that f has been opened
  * in binary mode for reading.  This function returns a pointer to the
  * newly loaded tablebase on success or NULL on error with errno
- * indicating the reason for failure.  Both uncompressed and compressed
- * table bases are supported, the code first tries to decompress the
- * table base, if it turns out to be uncompressed, another attempt is
- * made at reading an uncompressed tablebase.
+ * indicating the reason for failure.  Both uncompressed and xz
+ * compressed tablebases are supported and told apart by their first
+ * bytes.  The header of the tablebase (see dobutsutable.h) determines
+ * how much memory is needed and whether the tablebase holds distances
+ * to mate or only WDL information.  If f is a regular file holding
+ * exactly an uncompressed tablebase after its header, it is mapped
+ * into memory.  A tablebase compressed with multiple blocks is
+ * decompressed using one thread per processor.  If TB_ONDEMAND is
+ * given and the tablebase is compressed with multiple blocks, only the
+ * block index is read and blocks are decompressed as needed.  In this
+ * case, f can be closed afterwards.  The checksum in the header is
+ * verified whenever the tablebase is read into memory as a whole and
+ * with TB_VERIFY otherwise.
+ * flags is a combination of the TB_* flags from tablebase.h.
  */
 extern struct tablebase *
-read_tablebase(FILE *f)
+read_tablebase(FILE *f, int flags)
 {
 	struct tablebase *tb = malloc(sizeof *tb);
 	off_t startpos;
+	size_t count;
+	int error;
+	unsigned char buf[TBHDR_SIZE];
 
 	if (tb == NULL)
 		return (NULL);
 
+	tb->map = NULL;
+	tb->mapsize = 0;
+	tb->positions = NULL;
+	tb->cache = NULL;
+	tb->wdl = 0;
+	tb->pages = TB_PAGES_DEFAULT;
+
 	if (startpos = ftello(f), startpos == -1)
 		goto cleanup;
 
-	switch (read_xz_tablebase(f, tb)) {
-	case 0:
-		return (tb);
-
-	case 1:
-		goto cleanup;
+	count = fread(buf, 1, sizeof buf, f);
+	if (count >= sizeof xz_magic && memcmp(buf, xz_magic, sizeof xz_magic) == 0) {
+		if (read_compressed(f, tb, startpos, flags) != 0)
+			goto cleanup;
+	} else {
+		if (count != sizeof buf) {
+			if (!ferror(f))
+				errno = EINVAL;
 
-	case 2:
-		if (fseeko(f, startpos, SEEK_SET) == -1)
 			goto cleanup;
+		}
 
-		if (fread((void*)tb->positions, sizeof tb->positions, 1, f) != 1)
+		if (decode_tbheader(&tb->header, buf) != 0
+		    || read_uncompressed(f, tb, startpos + TBHDR_SIZE, flags) != 0)
 			goto cleanup;
+	}
 
-		return (tb);
+	tb->wdl = tb->header.encoding == TBHDR_WDL;
 
-	default:
-		assert(0);
-	}
+	return (tb);
 
 cleanup:
+	error = errno;
+	free_positions(tb);
 	free(tb);
+	errno = error;
 	return NULL;
 }
 
 /*
- * Read an xz compressed endgame tablebase.  Return 0 on success, 1 on
- * failure where the file could not possibly be an uncompressed
- * tablebase and 2 on failure where the file could be an uncompressed
- * tablebase.  In case of error, the tablebase contents are undefined.
+ * Read the uncompressed tablebase described by tb->header starting at
+ * offset startpos of f.  f must be positioned at startpos.  Return 0
+ * on success, -1 on failure.
+ */
+static int
+read_uncompressed(FILE *f, struct tablebase *tb, off_t startpos, int flags)
+{
+	size_t size = tb->header.size;
+
+	if (!(flags & TB_HUGEPAGE) && map_tablebase(f, tb, startpos, flags) == 0)
+		return (flags & TB_VERIFY ? check_crc(tb) : 0);
+
+	if (alloc_positions(tb, size, flags) != 0)
+		return (-1);
+
+	if (fread((void*)tb->positions, 1, size, f) != size) {
+		if (!ferror(f))
+			errno = EINVAL;
+
+		return (-1);
+	}
+
+	return (check_crc(tb));
+}
+
+/*
+ * Read the xz compressed tablebase starting at offset startpos of f.
+ * If it is made of multiple blocks, either prepare to load it on
+ * demand or decompress the blocks in parallel.  Otherwise, decompress
+ * it sequentially.  Return 0 on success, -1 on failure.
+ */
+static int
+read_compressed(FILE *f, struct tablebase *tb, off_t startpos, int flags)
+{
+	struct xz_index *index = NULL;
+	int fd = fileno(f);
+
+	if (fd != -1)
+		index = read_xz_index(fd, startpos);
+
+	if (index != NULL && index->nblock >= 2) {
+		if (flags & TB_ONDEMAND)
+			return (open_tbcache(fd, tb, index, flags));
+		else
+			return (read_xz_blocks(fd, tb, index, flags));
+	}
+
+	free(index);
+	if (fseeko(f, startpos, SEEK_SET) == -1)
+		return (-1);
+
+	return (read_xz_tablebase(f, tb, flags));
+}
+
+/*
+ * Try to map an uncompressed tablebase starting at offset startpos
+ * of f into memory.  This only works if f is a regular file containing
+ * nothing but the tablebase after startpos.  On success, fill in tb
+ * and return 0.  On failure, return -1 and leave tb unchanged.  The
+ * advice given in flags is applied to the mapping, failure to do so
+ * is ignored.
+ */
+static int
+map_tablebase(FILE *f, struct tablebase *tb, off_t startpos, int flags)
+{
+	struct stat st;
+	size_t size, slack;
+	long pagesize;
+	void *map;
+	int fd = fileno(f);
+
+	if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return (-1);
+
+	size = st.st_size - startpos;
+	if (size != tb->header.size)
+		return (-1);
+
+	/* mmap() needs a page-aligned offset */
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pagesize <= 0)
+		return (-1);
+
+	slack = startpos % pagesize;
+	map = mmap(NULL, size + slack, PROT_READ, MAP_SHARED, fd, startpos - slack);
+	if (map == MAP_FAILED)
+		return (-1);
+
+	if (flags & TB_WILLNEED)
+		posix_madvise(map, size + slack, POSIX_MADV_WILLNEED);
+
+	tb->map = map;
+	tb->mapsize = size + slack;
+	tb->positions = (atomic_schar*)((char*)map + slack);
+
+	return (0);
+}
+
+/*
+ * Check that the contents of tb match the checksum in its header.
+ * Return 0 if they do, -1 with errno set to EINVAL if they don't.
+ */
+static int
+check_crc(const struct tablebase *tb)
+{
+
+	if (tablebase_crc((const void*)tb->positions, tb->header.size) != tb->header.crc) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Decode the header at the beginning of the first block of a
+ * tablebase compressed with multiple blocks into tb->header and check
+ * that it agrees with the size recorded in index.  Return 0 on
+ * success, -1 with errno set on failure.
+ */
+static int
+check_block_header(struct tablebase *tb, const struct xz_index *index,
+    const unsigned char *first)
+{
+
+	if (index->block[0].outsize < TBHDR_SIZE) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (decode_tbheader(&tb->header, first) != 0)
+		return (-1);
+
+	if (index->outsize != TBHDR_SIZE + tb->header.size) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Read an xz compressed endgame tablebase.  The header is decompressed
+ * first, then memory for the tablebase is allocated and the rest of
+ * the stream is decompressed into it.  Return 0 on success, -1 on
+ * failure.  In case of error, the tablebase contents are undefined.
  */
 static int
-read_xz_tablebase(FILE *f, struct tablebase *tb)
+read_xz_tablebase(FILE *f, struct tablebase *tb, int flags)
 {
 	struct xz_buf xzb;
 	struct xz_dec *xzd;
 	size_t count;
 	int error;
+	unsigned char hdr[TBHDR_SIZE];
 	char inbuf[BUFSIZ];
 
 	/* as this function is idempotent, call it just to be sure */
@@ -154,61 +589,463 @@ read_xz_tablebase(FILE *f, struct tablebase *tb)
 	/* 4 MB is just the dictionary size we set in the Makefile */
 	xzd = xz_dec_init(XZ_PREALLOC, 1LU << 22);
 	if (xzd == NULL)
-		return (1);
+		return (-1);
 
 	xzb.in = (void*)inbuf;
 	xzb.in_pos = xzb.in_size = sizeof inbuf;
 
-	xzb.out = (void*)tb->positions;
+	xzb.out = hdr;
 	xzb.out_pos = 0;
-	xzb.out_size = sizeof tb->positions;
+	xzb.out_size = sizeof hdr;
 
-	do {
-		/*
-		 * if error is XZ_OK, then we either need more input or
-		 * more output space.  The latter can only happen if the
-		 * file is not a tablebase file.
-		 */
-		if (xzb.in_pos != xzb.in_size)
-			goto permanent_error;
+	for (;;) {
+		if (xzb.in_pos == xzb.in_size) {
+			count = fread(inbuf, 1, sizeof inbuf, f);
+			if (count == 0) {
+				if (ferror(f))
+					goto fail;
+				else
+					goto invalid;
+			}
 
-		count = fread(inbuf, 1, sizeof inbuf, f);
-		if (count == 0)
-			goto permanent_error;
+			xzb.in_pos = 0;
+			xzb.in_size = count;
+		}
 
-		xzb.in_pos = 0;
-		xzb.in_size = count;
-	} while (error = xz_dec_run(xzd, &xzb), error == XZ_OK);
+		error = xz_dec_run(xzd, &xzb);
+		if (error != XZ_OK)
+			break;
+
+		/* once the header is complete, continue with the tablebase */
+		if (xzb.out == hdr && xzb.out_pos == xzb.out_size) {
+			if (decode_tbheader(&tb->header, hdr) != 0
+			    || alloc_positions(tb, tb->header.size, flags) != 0)
+				goto fail;
+
+			xzb.out = (void*)tb->positions;
+			xzb.out_pos = 0;
+			xzb.out_size = tb->header.size;
+		}
+	}
 
 	switch (error) {
 	case XZ_STREAM_END:
 		/* check if the file had the right size */
-		if (xzb.out_pos != xzb.out_size)
-			goto permanent_error;
+		if (xzb.out == hdr || xzb.out_pos != xzb.out_size)
+			goto invalid;
 
 		xz_dec_end(xzd);
-		return (0);
+		return (check_crc(tb));
 
-	case XZ_UNSUPPORTED_CHECK:
 	case XZ_MEM_ERROR:
 	case XZ_MEMLIMIT_ERROR:
+		errno = ENOMEM;
+		goto fail;
+
+	/* XZ_BUF_ERROR means that there is more data than expected */
+	case XZ_UNSUPPORTED_CHECK:
 	case XZ_OPTIONS_ERROR:
 	case XZ_DATA_ERROR:
-		goto permanent_error;
-
 	case XZ_FORMAT_ERROR:
-		xz_dec_end(xzd);
-		return (2);		
-
-	/* these would indicate programming errors */
 	case XZ_BUF_ERROR:
+		goto invalid;
+
+	/* this would indicate a programming error */
 	case XZ_OK:
 	default:
 		assert(0);
 		abort();
 	}
 
-permanent_error:
+invalid:
+	errno = EINVAL;
+fail:
+	error = errno;
 	xz_dec_end(xzd);
-	return (1);
+	errno = error;
+	return (-1);
+}
+
+/*
+ * Decompress an xz compressed tablebase made of multiple blocks
+ * described by index from the file referred to by fd.  The first
+ * block is decompressed to obtain the header and allocate memory for
+ * the tablebase.  The remaining blocks are then distributed over a
+ * pool of threads, each decompressing its blocks directly to their
+ * place in tb->positions.  index is released.  Return 0 on success,
+ * -1 on failure.  In case of error, the tablebase contents are
+ * undefined.
+ */
+static int
+read_xz_blocks(int fd, struct tablebase *tb, struct xz_index *index, int flags)
+{
+	struct xzload_state xzls;
+	struct xz_dec *xzd;
+	pthread_t pool[XZLOAD_MAX_THREADS - 1];
+	long nproc;
+	size_t i, threads;
+	int error;
+	unsigned char *inbuf, *first;
+
+	/* 4 MB is just the dictionary size we set in the Makefile */
+	xzd = xz_dec_init(XZ_PREALLOC, 1LU << 22);
+	inbuf = malloc(index->maxinsize);
+	first = malloc(index->block[0].outsize);
+	if (xzd == NULL || inbuf == NULL || first == NULL) {
+		errno = ENOMEM;
+		goto fail_first;
+	}
+
+	if (decode_xz_block(xzd, fd, index, 0, first, inbuf) != 0
+	    || check_block_header(tb, index, first) != 0
+	    || alloc_positions(tb, tb->header.size, flags) != 0)
+		goto fail_first;
+
+	memcpy((void*)tb->positions, first + TBHDR_SIZE, index->block[0].outsize - TBHDR_SIZE);
+	free(first);
+	free(inbuf);
+	xz_dec_end(xzd);
+
+	nproc = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = nproc < 1 ? 1 : nproc > XZLOAD_MAX_THREADS ? XZLOAD_MAX_THREADS : nproc;
+	if (threads > index->nblock - 1)
+		threads = index->nblock - 1;
+
+	error = pthread_mutex_init(&xzls.lock, NULL);
+	if (error != 0) {
+		free(index);
+		errno = error;
+		return (-1);
+	}
+
+	xzls.next = 1;
+	xzls.error = 0;
+	xzls.index = index;
+	xzls.tb = tb;
+	xzls.fd = fd;
+
+	/*
+	 * The calling thread takes part in the work, so if we fail to
+	 * create some threads, we just continue with fewer.
+	 */
+	for (i = 0; i < threads - 1; i++)
+		if (pthread_create(pool + i, NULL, xzload_worker, &xzls) != 0)
+			break;
+
+	threads = i;
+	xzload_worker(&xzls);
+
+	for (i = 0; i < threads; i++)
+		pthread_join(pool[i], NULL);
+
+	pthread_mutex_destroy(&xzls.lock);
+	free(index);
+
+	if (xzls.error != 0) {
+		errno = xzls.error;
+		return (-1);
+	}
+
+	return (check_crc(tb));
+
+fail_first:
+	error = errno;
+	free(first);
+	free(inbuf);
+	if (xzd != NULL)
+		xz_dec_end(xzd);
+
+	free(index);
+	errno = error;
+	return (-1);
+}
+
+/*
+ * Decompress blocks until none are left or an error occurs.  See
+ * read_xz_blocks() for details.  As the header precedes the
+ * tablebase, the uncompressed data of each block belongs TBHDR_SIZE
+ * bytes before its offset in the stream.
+ */
+static void *
+xzload_worker(void *xzls_arg)
+{
+	struct xzload_state *xzls = xzls_arg;
+	struct xz_dec *xzd;
+	unsigned char *inbuf;
+	size_t block;
+	int error, failure = 0;
+
+	/* 4 MB is just the dictionary size we set in the Makefile */
+	xzd = xz_dec_init(XZ_PREALLOC, 1LU << 22);
+	inbuf = malloc(xzls->index->maxinsize);
+	if (xzd == NULL || inbuf == NULL)
+		failure = ENOMEM;
+
+	for (;;) {
+		error = pthread_mutex_lock(&xzls->lock);
+		assert(error == 0);
+
+		/* on error, make the other threads stop, too */
+		if (failure != 0) {
+			if (xzls->error == 0)
+				xzls->error = failure;
+
+			xzls->next = xzls->index->nblock;
+		}
+
+		block = xzls->next;
+		if (block < xzls->index->nblock)
+			xzls->next++;
+
+		error = pthread_mutex_unlock(&xzls->lock);
+		assert(error == 0);
+
+		if (block >= xzls->index->nblock)
+			break;
+
+		if (decode_xz_block(xzd, xzls->fd, xzls->index, block,
+		    (unsigned char*)xzls->tb->positions + xzls->index->block[block].outstart - TBHDR_SIZE,
+		    inbuf) != 0)
+			failure = errno;
+	}
+
+	free(inbuf);
+	if (xzd != NULL)
+		xz_dec_end(xzd);
+
+	return (NULL);
+}
+
+/*
+ * Prepare tb for loading the xz compressed tablebase made of multiple
+ * blocks described by index from the file referred to by fd on demand.
+ * The first block is loaded right away to read the header.  If flags
+ * contains TB_VERIFY, all blocks are decompressed once to check the
+ * checksum in the header, so a corrupt file is rejected here instead
+ * of in lookup_cached().  index is taken over by the cache or released
+ * on failure.  Return 0 on success, -1 on failure.
+ */
+static int
+open_tbcache(int fd, struct tablebase *tb, struct xz_index *index, int flags)
+{
+	struct tbcache *cache;
+	struct tbcache_slot *slot;
+	size_t i;
+	int error;
+
+	cache = malloc(sizeof *cache);
+	if (cache == NULL)
+		goto fail_index;
+
+	cache->index = index;
+	cache->fd = dup(fd);
+	if (cache->fd == -1)
+		goto fail_cache;
+
+	/* 4 MB is just the dictionary size we set in the Makefile */
+	cache->xzd = xz_dec_init(XZ_PREALLOC, 1LU << 22);
+	if (cache->xzd == NULL)
+		goto fail_fd;
+
+	cache->inbuf = malloc(index->maxinsize);
+	if (cache->inbuf == NULL)
+		goto fail_xzd;
+
+	cache->slot_of = malloc(index->nblock * sizeof *cache->slot_of);
+	if (cache->slot_of == NULL)
+		goto fail_inbuf;
+
+	if (pthread_rwlock_init(&cache->lock, NULL) != 0)
+		goto fail_slot_of;
+
+	for (i = 0; i < index->nblock; i++)
+		cache->slot_of[i] = -1;
+
+	for (i = 0; i < TBCACHE_SLOTS; i++) {
+		cache->slot[i].data = NULL;
+		cache->slot[i].used = 0;
+		cache->slot[i].block = -1;
+	}
+
+	cache->tick = 0;
+
+	slot = load_block(cache, 0);
+	if (slot == NULL || check_block_header(tb, index, slot->data) != 0
+	    || (flags & TB_VERIFY && check_blocks(cache, tb) != 0)) {
+		error = errno;
+		free_tbcache(cache);
+		errno = error;
+		return (-1);
+	}
+
+	tb->cache = cache;
+
+	return (0);
+
+fail_slot_of:
+	free(cache->slot_of);
+fail_inbuf:
+	free(cache->inbuf);
+fail_xzd:
+	xz_dec_end(cache->xzd);
+fail_fd:
+	close(cache->fd);
+fail_cache:
+	free(cache);
+fail_index:
+	free(index);
+	return (-1);
+}
+
+/*
+ * Release all resources associated with cache.
+ */
+static void
+free_tbcache(struct tbcache *cache)
+{
+	size_t i;
+
+	for (i = 0; i < TBCACHE_SLOTS; i++)
+		free(cache->slot[i].data);
+
+	pthread_rwlock_destroy(&cache->lock);
+	free(cache->slot_of);
+	free(cache->inbuf);
+	xz_dec_end(cache->xzd);
+	close(cache->fd);
+	free(cache->index);
+	free(cache);
+}
+
+/*
+ * Return the slot of cache holding block, decompressing the block into
+ * the least recently used slot if it isn't cached yet.  cache->lock
+ * must be held for writing unless cache isn't shared yet.  Return NULL
+ * with errno set if the block cannot be loaded.
+ */
+static struct tbcache_slot *
+load_block(struct tbcache *cache, size_t block)
+{
+	struct tbcache_slot *slot;
+	size_t i;
+
+	if (cache->slot_of[block] >= 0)
+		slot = cache->slot + cache->slot_of[block];
+	else {
+		/* evict least recently used block */
+		slot = cache->slot;
+		for (i = 1; i < TBCACHE_SLOTS; i++)
+			if (cache->slot[i].used < slot->used)
+				slot = cache->slot + i;
+
+		if (slot->block >= 0)
+			cache->slot_of[slot->block] = -1;
+
+		slot->block = -1;
+		slot->used = 0;
+		free(slot->data);
+		slot->data = malloc(cache->index->block[block].outsize);
+		if (slot->data == NULL
+		    || decode_xz_block(cache->xzd, cache->fd, cache->index, block,
+		    slot->data, cache->inbuf) != 0)
+			return (NULL);
+
+		slot->block = block;
+		cache->slot_of[block] = slot - cache->slot;
+	}
+
+	slot->used = ++cache->tick;
+
+	return (slot);
+}
+
+/*
+ * Decompress each block of cache in turn and check that together, they
+ * match the checksum in the header of tb.  The xz decoder checks each
+ * block on its own, too.  Return 0 on success, -1 with errno set on
+ * failure.
+ */
+static int
+check_blocks(struct tbcache *cache, const struct tablebase *tb)
+{
+	struct tbcache_slot *slot;
+	size_t i, skip;
+	unsigned crc = 0;
+
+	xz_crc32_init();
+
+	for (i = 0; i < cache->index->nblock; i++) {
+		slot = load_block(cache, i);
+		if (slot == NULL)
+			return (-1);
+
+		/* the checksum doesn't cover the header */
+		skip = i == 0 ? TBHDR_SIZE : 0;
+		crc = xz_crc32(slot->data + skip, cache->index->block[i].outsize - skip, crc);
+	}
+
+	if (crc != tb->header.crc) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Return the byte at offset in a tablebase loaded on demand,
+ * decompressing the block containing it if it isn't cached yet.  As
+ * lookup_position() has no way to report errors, failure to load a
+ * block is fatal.  The xz decoder checks each block as it is
+ * decompressed, so a corrupt block is never used.  If the block is
+ * cached, cache->lock is only taken for reading.
+ */
+static int
+lookup_cached(const struct tablebase *tb, size_t offset)
+{
+	struct tbcache *cache = tb->cache;
+	struct tbcache_slot *slot;
+	size_t block;
+	int error, e, s;
+
+	/* skip the header */
+	offset += TBHDR_SIZE;
+	block = find_xz_block(cache->index, offset);
+
+	error = pthread_rwlock_rdlock(&cache->lock);
+	assert(error == 0);
+
+	s = cache->slot_of[block];
+	if (s >= 0) {
+		slot = cache->slot + s;
+
+		/* avoid writing to a shared cache line if we can */
+		if (slot->used != cache->tick)
+			slot->used = cache->tick;
+
+		e = slot->data[offset - cache->index->block[block].outstart];
+	}
+
+	error = pthread_rwlock_unlock(&cache->lock);
+	assert(error == 0);
+
+	if (s >= 0)
+		return (e);
+
+	/* another thread may load the block first, load_block() handles that */
+	error = pthread_rwlock_wrlock(&cache->lock);
+	assert(error == 0);
+
+	slot = load_block(cache, block);
+	if (slot == NULL) {
+		perror("lookup_position");
+		abort();
+	}
+
+	e = slot->data[offset - cache->index->block[block].outstart];
+
+	error = pthread_rwlock_unlock(&cache->lock);
+	assert(error == 0);
+
+	return (e);
 }
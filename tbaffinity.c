@@ -0,0 +1,155 @@
+/*-
+ * Copyright (c) 2016--2017 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _GNU_SOURCE /* for sched_getaffinity() and pthread_setaffinity_np() */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__GLIBC__)
+# include <sched.h>
+# define HAVE_AFFINITY
+typedef cpu_set_t affinity_set;
+# define get_affinity(set) sched_getaffinity(0, sizeof *(set), (set))
+#elif defined(__FreeBSD__)
+# include <sys/param.h>
+# include <sys/cpuset.h>
+# include <pthread_np.h>
+# define HAVE_AFFINITY
+typedef cpuset_t affinity_set;
+# define get_affinity(set) cpuset_getaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1, \
+    sizeof *(set), (set))
+#endif
+
+#include "dobutsutable.h"
+
+/*
+ * On machines with more than one NUMA node, memory access is fastest
+ * from the CPUs of the node the memory is placed on.  Linux places a
+ * page on the node of the thread that first touches it.  The functions
+ * in this file allow the generator to pin its threads to CPUs and to
+ * find out which node a CPU belongs to, so the threads can touch and
+ * later work on the memory local to them.  Threads are pinned with
+ * the interfaces of glibc on Linux and the native cpuset interface on
+ * FreeBSD.  Elsewhere, threads are not pinned.  Nodes are only known
+ * on Linux, all CPUs are assumed to belong to node 0 otherwise.
+ */
+
+enum {
+	/* highest NUMA node number looked for */
+	MAX_NODES = 1024,
+};
+
+/*
+ * Return the CPU thread i should be pinned to: the i-th CPU the
+ * process may run on, wrapping around if there are fewer CPUs than
+ * threads.  Return -1 if this cannot be determined.
+ */
+extern int
+thread_cpu(int i)
+{
+#ifdef HAVE_AFFINITY
+	affinity_set set;
+	int cpu, count = 0;
+
+	if (get_affinity(&set) != 0)
+		return (-1);
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		count += !!CPU_ISSET(cpu, &set);
+
+	if (count == 0)
+		return (-1);
+
+	i %= count;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &set) && i-- == 0)
+			return (cpu);
+#else
+	(void)i;
+#endif
+
+	return (-1);
+}
+
+/*
+ * Pin the calling thread to cpu.  Return 0 on success, -1 on failure
+ * with errno set.
+ */
+extern int
+pin_thread(int cpu)
+{
+#ifdef HAVE_AFFINITY
+	affinity_set set;
+	int error;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	error = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+	if (error != 0) {
+		errno = error;
+		return (-1);
+	}
+
+	return (0);
+#else
+	(void)cpu;
+	errno = ENOSYS;
+	return (-1);
+#endif
+}
+
+/*
+ * Return the NUMA node cpu belongs to or 0 if unknown.  The node is
+ * taken from sysfs, where each node's directory holds a link to each
+ * of its CPUs.  Node numbers need not be contiguous, so all possible
+ * ones are tried.
+ */
+extern int
+cpu_node(int cpu)
+{
+#ifdef __linux__
+	char path[64];
+	int node;
+
+	if (cpu < 0)
+		return (0);
+
+	for (node = 0; node < MAX_NODES; node++) {
+		snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpu%d", node, cpu);
+		if (access(path, F_OK) == 0)
+			return (node);
+	}
+#else
+	(void)cpu;
+#endif
+
+	return (0);
+}
@@ -0,0 +1,146 @@
+/*-
+ * Copyright (c) 2016--2017 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* for MAP_ANONYMOUS, MAP_HUGETLB, and madvise() */
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "dobutsutable.h"
+
+/*
+ * Lookups and the generator access the tablebase at random, so with
+ * normal pages, nearly every access misses the TLB.  The functions in
+ * this file allocate the tablebase array such that it is backed by
+ * huge pages if requested and possible.  First, explicit huge pages
+ * (MAP_HUGETLB) are tried.  These only exist if the administrator has
+ * reserved some.  Failing that, an anonymous mapping aligned to the
+ * huge page size is created and the kernel is asked to back it with
+ * transparent huge pages (MADV_HUGEPAGE).  If that doesn't work
+ * either, malloc() is used.
+ */
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+enum {
+	/* the huge page size on x86 and most other platforms */
+	HUGEPAGE_SIZE = 2 * 1024 * 1024,
+};
+
+static const char *const page_names[] = {
+	[TB_PAGES_DEFAULT] = "default",
+	[TB_PAGES_TRANSPARENT] = "transparent",
+	[TB_PAGES_HUGETLB] = "hugetlb",
+};
+
+/*
+ * Allocate size zero-initialized bytes for tb->positions and record
+ * how the memory was obtained in tb.  If flags contains TB_HUGEPAGE,
+ * try to back the memory with huge pages.  Return 0 on success, -1 on
+ * failure.
+ */
+extern int
+alloc_positions(struct tablebase *tb, size_t size, int flags)
+{
+	size_t mapsize = (size + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+	char *map, *aligned;
+
+	tb->map = NULL;
+	tb->mapsize = 0;
+	tb->pages = TB_PAGES_DEFAULT;
+
+	if (flags & TB_HUGEPAGE) {
+#ifdef MAP_HUGETLB
+		map = mmap(NULL, mapsize, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (map != MAP_FAILED) {
+			tb->map = map;
+			tb->mapsize = mapsize;
+			tb->positions = (atomic_schar*)map;
+			tb->pages = TB_PAGES_HUGETLB;
+
+			return (0);
+		}
+#endif
+
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+		/* map a little more so we can trim it to an aligned region */
+		map = mmap(NULL, mapsize + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map != MAP_FAILED) {
+			aligned = (char*)(((uintptr_t)map + HUGEPAGE_SIZE - 1)
+			    & ~(uintptr_t)(HUGEPAGE_SIZE - 1));
+			if (aligned > map)
+				munmap(map, aligned - map);
+
+			munmap(aligned + mapsize, map + HUGEPAGE_SIZE - aligned);
+
+			tb->map = aligned;
+			tb->mapsize = mapsize;
+			tb->positions = (atomic_schar*)aligned;
+			if (madvise(aligned, mapsize, MADV_HUGEPAGE) == 0)
+				tb->pages = TB_PAGES_TRANSPARENT;
+
+			return (0);
+		}
+#endif
+	}
+
+	tb->positions = calloc(size, 1);
+
+	return (tb->positions == NULL ? -1 : 0);
+}
+
+/*
+ * Release the memory tb->positions refers to, be it allocated with
+ * alloc_positions() or mapped from a file.
+ */
+extern void
+free_positions(struct tablebase *tb)
+{
+
+	if (tb->mapsize != 0)
+		munmap(tb->map, tb->mapsize);
+	else
+		free((void*)tb->positions);
+
+	tb->positions = NULL;
+	tb->map = NULL;
+	tb->mapsize = 0;
+}
+
+/*
+ * Return a string describing what kind of pages back tb: "hugetlb" for
+ * explicit huge pages, "transparent" if transparent huge pages have
+ * been requested successfully, or "default" for normal pages.
+ */
+extern const char *
+tablebase_pages(const struct tablebase *tb)
+{
+
+	return (page_names[tb->pages]);
+}
@@ -25,72 +25,271 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "dobutsutable.h"
 
+struct gentb_state;
+struct gentb_slice;
+struct gentb_stats;
+struct gentb_table;
+
 static void	*gentb_worker(void *);
-static void	 initial_round_chunk(struct tablebase *, poscode, unsigned *, unsigned *);
-static void	 initial_round_pos(struct tablebase *, poscode, unsigned *, unsigned *);
-static void	 normal_round_chunk(struct tablebase *, poscode, unsigned *, unsigned *, unsigned);
-static void	 normal_round_pos(struct tablebase *, poscode, int, unsigned *, unsigned *);
-static void	 mark_position(struct tablebase *, const struct position *, tb_entry);
-static void	 count_wdl(struct tablebase *);
+static int	 take_slice(struct gentb_state *, int, size_t *);
+static void	 finish_round(struct gentb_state *);
+static void	 reset_deques(struct gentb_state *);
+static void	 thread_slices(const struct gentb_state *, int, size_t *, size_t *);
+static struct gentb_slice *make_slices(size_t *);
+static int	 compare_slices(const void *, const void *);
+static size_t	 slice_offset(const struct gentb_slice *);
+static int	 place_memory(struct gentb_state *);
+static void	*place_worker(void *);
+static void	 touch_range(volatile void *, size_t, size_t);
+static void	 touch_interleaved(volatile void *, size_t, int, int);
+static int	 write_checkpoint(const struct gentb_state *, const char *);
+static int	 read_checkpoint(struct gentb_state *, const char *);
+static void	 rebuild_counters(struct gentb_state *);
+static void	 write_telemetry(const struct gentb_state *, const struct gentb_stats *,
+		     const struct timespec *);
+static void	 add_stats(struct gentb_stats *, const struct gentb_stats *);
+static int	 write_tbfile(FILE *, struct tbheader *, const void *, size_t);
+static double	 elapsed(const struct timespec *, const struct timespec *);
+static void	 initial_round_slice(struct gentb_table *, atomic_ulong *, atomic_uchar *,
+		     const struct gentb_slice *, struct gentb_stats *);
+static void	 initial_round_pos(struct gentb_table *, atomic_ulong *, atomic_uchar *,
+		     const struct poscode_decoder *, struct gentb_stats *);
+static void	 normal_round_slice(struct gentb_table *, const atomic_ulong *, atomic_ulong *,
+		     atomic_uchar *, const struct gentb_slice *, struct gentb_stats *, unsigned);
+static void	 normal_round_pos(struct gentb_table *, atomic_ulong *, poscode, int,
+		     struct gentb_stats *);
+static void	 counter_round_pos(struct gentb_table *, atomic_ulong *, atomic_uchar *, poscode, int,
+		     struct gentb_stats *);
+static void	 mark_loss(struct gentb_table *, atomic_ulong *, const struct xposition *, size_t, int,
+		     struct gentb_stats *);
+static size_t	 class_offset(const struct position *, size_t, struct gentb_stats *);
+static void	 mark_position(struct gentb_table *, atomic_ulong *, const struct position *, tb_entry,
+		     struct gentb_stats *);
+static void	 forward_loss_slice(struct gentb_table *, const atomic_ulong *, atomic_ulong *,
+		     const struct gentb_slice *, struct gentb_stats *, unsigned);
+static tb_entry	 forward_loss_pos(const struct gentb_table *, const struct position *,
+		     struct gentb_stats *, unsigned);
+static void	 forward_win_slice(struct gentb_table *, atomic_ulong *, const atomic_ulong *,
+		     const struct gentb_slice *, struct gentb_stats *, unsigned);
+static int	 forward_win_pos(const atomic_ulong *, const struct position *, struct gentb_stats *);
+static int	 is_decided(const struct gentb_table *, size_t);
+static int	 won_within(const struct gentb_table *, const atomic_ulong *, size_t, tb_entry);
+static void	 set_entry(struct gentb_table *, size_t, tb_entry);
+static int	 set_win(struct gentb_table *, atomic_ulong *, size_t, tb_entry);
+static int	 set_loss(struct gentb_table *, size_t, tb_entry);
+static int	 test_bit(const atomic_ulong *, size_t);
+static int	 set_bit(atomic_ulong *, size_t);
+static void	 count_wdl(struct tablebase *, const atomic_ulong *, const atomic_ulong *);
+
+enum {
+	/* number of bits in a frontier bitmap word */
+	FRONTIER_WORD_BITS = CHAR_BIT * sizeof (unsigned long),
+
+	/* number of words in a frontier bitmap */
+	FRONTIER_WORDS = (POSITION_TOTAL_COUNT + FRONTIER_WORD_BITS - 1) / FRONTIER_WORD_BITS,
+
+	/* number of words in a bitmap with one bit per position not stored */
+	UNSTORED_WORDS = (POSITION_TOTAL_COUNT - POSITION_COUNT + FRONTIER_WORD_BITS - 1)
+	    / FRONTIER_WORD_BITS,
+
+	/* maximal number of positions in a slice of work */
+	GENTB_SLICE_SIZE = 8192,
+
+	/* assumed size of a cache line */
+	CACHE_LINE_SIZE = 64,
+
+	/* granularity of GENTB_PLACE_INTERLEAVE, the huge page size */
+	PLACEMENT_BLOCK = 2 * 1024 * 1024,
+};
+
+/*
+ * A slice of work for the generator threads: the positions first to
+ * last (exclusive) of the chunk of the encoding space with the given
+ * ownership and cohort, counted from the beginning of the chunk.  The
+ * size of a chunk depends on its cohort and varies between 21 and
+ * 396900 positions, so chunks are split into slices of at most
+ * GENTB_SLICE_SIZE positions to make the amount of work per slice
+ * roughly uniform.
+ */
+struct gentb_slice {
+	unsigned char ownership, cohort;
+	unsigned first, last;
+};
+
+/*
+ * The tablebase under construction.  Only positions whose ownership is
+ * stored, i.e. those at offsets below POSITION_COUNT, have an entry in
+ * tb->positions.  The other positions are never written to disk, but
+ * as they are the predecessors and successors of stored positions,
+ * the generator must still keep track of them.  Their distance to mate
+ * is not needed for that: the bitmaps won and lost, indexed by offset
+ * minus POSITION_COUNT, tell if they are won or lost and the frontier
+ * bitmaps tell if they were won in the current round.  This way, the
+ * generator needs a third less memory.  The functions is_decided(),
+ * won_within(), set_entry(), set_win(), and set_loss() hide the
+ * difference from the rest of the generator.
+ */
+struct gentb_table {
+	struct tablebase *tb;
+	atomic_ulong *won, *lost;
+};
+
+/*
+ * Statistics about the work done in a round.  win and loss are the
+ * number of winning and losing positions found.  scanned is the number
+ * of positions looked at and frontier the number of those that were
+ * actually due for processing.  unmoves is the number of unmoves
+ * returned by generate_unmoves().  encodes and atomics count calls to
+ * the encoding functions and atomic operations on the tablebase or
+ * the frontier bitmaps.
+ */
+struct gentb_stats {
+	unsigned win, loss;
+	unsigned long long scanned, frontier, unmoves, encodes, atomics;
+};
+
+/*
+ * Per-thread state.  deque holds the range of slices this thread has
+ * yet to work on in the current round with the index of the first
+ * slice in the low 32 bits and the index one past the last slice in
+ * the high 32 bits.  The thread takes slices from the front of its
+ * own deque and steals slices from the back of other threads' deques
+ * once its own deque is empty.  Both is done by atomically replacing
+ * deque using atomic_compare_exchange_strong().  stats holds the work
+ * the thread did in the current round and idle the time at which it
+ * ran out of work.  Both are only written by the thread itself.  cpu
+ * is the CPU the thread is pinned to or -1 if it is not pinned, node
+ * the NUMA node of that CPU.  The structure is padded such that the
+ * members of different threads do not share a cache line.
+ */
+struct gentb_thread {
+	atomic_ullong deque;
+	struct gentb_stats stats;
+	struct timespec idle;
+	struct gentb_state *gtbs;
+	int id, cpu, node;
+
+	char padding[CACHE_LINE_SIZE];
+};
 
 /*
  * This structure is used to coordinate work between the threads.  The
- * members win, loss, round, and pc may only be modified while lock is
- * held.  round_barrier is used to synchronize the threads after one
- * round has finished.  win and loss contain the number of winning and
- * losing positions in the current round, round the current round and
- * pc the last chunk of the encoding space fetched for work.  The member
- * tb contains a pointer to the tablebase we currently work on.  It must
- * not be written asynchronously, lock doesn't need to be held to access
- * it.
+ * encoding space is split into nslice slices (see struct gentb_slice)
+ * stored in slices.  At the beginning of each round, each of the
+ * nthread threads is assigned an equally large range of consecutive
+ * slices through the deque in its struct gentb_thread.  A thread works
+ * through its own slices and then steals slices from other threads
+ * until no slices are left.  Neither requires a lock.  The thread then
+ * waits on round_barrier.  The thread pthread_barrier_wait() picks as
+ * the serial thread calls finish_round() to sum up the threads'
+ * statistics into win and loss, print them, and prepare the next
+ * round while the other threads wait on round_barrier a second
+ * time.  If no losing positions were found in the previous round or
+ * opts->max_rounds rounds have been done, done is set and all threads
+ * terminate.  round is the number of the current round.  table is the
+ * tablebase we currently work on and opts points to the options we
+ * were called with.  last_checkpoint is the time the last
+ * checkpoint was written or generation started, round_start the time
+ * the current round started.  Apart from the members of thread, the
+ * members are only modified before the threads are started or by
+ * finish_round().
+ *
+ * frontier and next are bitmaps with one bit per position in the
+ * tablebase.  In round n, frontier has a bit set for every position
+ * marked as won in n moves, these are the positions processed in this
+ * round.  Positions marked as won in n + 1 moves during this round are
+ * recorded in next.  When a new round is opened, the two bitmaps are
+ * swapped and next is cleared.  This way, only the initial round needs
+ * to look at every position.
  *
- * The workflow is as follows: Every thread has an internal round
- * counter.  When looking for work, the thread first locks lock and then
- * compares its own round counter to round.  If the values differ that
- * means that this thread is the first to do work on the new round and
- * initializes win, loss, and pc.  Then the thread takes one chunk of
- * work, increments pc appropriately and releases lock.  If the thread
- * was the first to do work in this round, it prints status information
- * from the previous round.  If no work is left to do, the thread
- * instead waits on round_barrier.  As a special case, if the thread
- * notices that it's the first to do work in the current round and the
- * loss counter stands at zero (meaning, no losses were found in the
- * previous round) then it leaves the state unchanged and terminates.
+ * With opts->algorithm == GENTB_FORWARD, every round looks at every
+ * position not yet decided and consists of two phases, phase being
+ * the current one.  In phase 0, the positions lost in round moves are
+ * found and recorded in next, in phase 1 those won in round + 1 moves.
+ * The latter are recorded in frontier, which is cleared between the
+ * two phases and not swapped with next.  See forward_loss_slice() for
+ * details.
+ *
+ * With opts->algorithm == GENTB_COUNTER, counters holds one byte per
+ * position.  See counter_round_pos() for what it contains.  It is NULL
+ * with the other algorithms.
  */
 struct gentb_state {
-	pthread_mutex_t lock;
-
-	/* members for which lock must be held */
+	pthread_barrier_t round_barrier;
+	struct gentb_table table;
+	const struct gentb_options *opts;
+	time_t last_checkpoint;
+	struct timespec round_start;
+	atomic_ulong *frontier, *next;
+	atomic_uchar *counters;
+	struct gentb_slice *slices;
+	size_t nslice;
 	unsigned win, loss;
 	unsigned round;
-	poscode pc;
+	int nthread, done, phase;
 
-	/* members not protected by lock */
-	pthread_barrier_t round_barrier;
-	struct tablebase *tb;
+	struct gentb_thread thread[GENTB_MAX_THREADS];
+};
+
+/*
+ * A checkpoint file consists of this header followed by the
+ * POSITION_COUNT entries of the tablebase under construction, the
+ * bitmaps won and lost of struct gentb_table, and the frontier of the
+ * next round.  size is POSITION_TOTAL_COUNT.  round is the next round
+ * to execute, win and loss are the results of the round before.
+ * Checkpoints are written in native byte order and are only meant to
+ * be read back on the machine that wrote them.
+ */
+struct gentb_checkpoint {
+	char magic[8];
+	unsigned long long size;
+	unsigned round, win, loss;
 };
 
+static const char checkpoint_magic[8] = { 'D', 'B', 'T', 'B', 'C', 'K', 'P', '4' };
+
 /*
  * This function generates a complete tablebase and returns the
  * generated table base or NULL in case of error with errno containing
  * the reason for failure.  Progress information may be printed to
- * stderr in the process.  The threads argument indicates the number of
+ * stderr in the process.  opts->threads indicates the number of
  * threads used to generate the tablebase.  The number of threads must
- * be positive and not larger than GENTB_MAX_THREADS.
+ * be positive and not larger than GENTB_MAX_THREADS.  See struct
+ * gentb_options for the other options.  Failure to write a checkpoint
+ * is reported to stderr but otherwise ignored.  If opts->workdir is
+ * set, the tablebase is generated out of core by
+ * generate_partitioned() in tbpartition.c, which supports only a
+ * subset of the options, see struct gentb_options.
  */
 extern struct tablebase *
-generate_tablebase(int threads)
+generate_tablebase(const struct gentb_options *opts)
 {
 	struct gentb_state gtbs;
+	struct tablebase *tb;
 	pthread_t pool[GENTB_MAX_THREADS];
-	int i, j, error;
+	int i, j, error, threads = opts->threads;
+
+	if (opts->workdir != NULL) {
+		if (opts->checkpoint != NULL || opts->resume != NULL
+		    || opts->threads != 1 || opts->algorithm != GENTB_COUNTER
+		    || opts->telemetry != NULL || opts->flags & TB_HUGEPAGE
+		    || opts->pin || opts->placement != GENTB_PLACE_DEFAULT) {
+			errno = EINVAL;
+			return (NULL);
+		}
+
+		return (generate_partitioned(opts));
+	}
 
 	if (threads <= 0) {
 		errno = EINVAL;
@@ -101,24 +300,71 @@ generate_tablebase(int threads)
 		threads = GENTB_MAX_THREADS;
 
 	memset(&gtbs, 0, sizeof gtbs);
-	error = pthread_mutex_init(&gtbs.lock, NULL);
+	error = pthread_barrier_init(&gtbs.round_barrier, NULL, threads);
 	if (error != 0) {
 		errno = error;
 		return (NULL);
 	}
 
-	error = pthread_barrier_init(&gtbs.round_barrier, NULL, threads);
-	if (error != 0) {
-		errno = error;
-		return (NULL);
+	tb = malloc(sizeof *tb);
+	if (tb == NULL)
+		goto fail_barrier;
+
+	tb->cache = NULL;
+	tb->wdl = 0;
+	if (alloc_positions(tb, POSITION_COUNT, opts->flags) != 0)
+		goto fail_tb;
+
+	gtbs.table.tb = tb;
+	gtbs.table.won = calloc(UNSTORED_WORDS, sizeof *gtbs.table.won);
+	gtbs.table.lost = calloc(UNSTORED_WORDS, sizeof *gtbs.table.lost);
+	gtbs.frontier = calloc(FRONTIER_WORDS, sizeof *gtbs.frontier);
+	gtbs.next = calloc(FRONTIER_WORDS, sizeof *gtbs.next);
+	if (gtbs.table.won == NULL || gtbs.table.lost == NULL
+	    || gtbs.frontier == NULL || gtbs.next == NULL)
+		goto fail_frontier;
+
+	if (opts->algorithm == GENTB_COUNTER) {
+		gtbs.counters = calloc(POSITION_TOTAL_COUNT, sizeof *gtbs.counters);
+		if (gtbs.counters == NULL)
+			goto fail_frontier;
 	}
 
-	gtbs.tb = calloc(POSITION_TOTAL_COUNT, 1);
-	if (gtbs.tb == NULL)
-		return (NULL);
+	gtbs.slices = make_slices(&gtbs.nslice);
+	if (gtbs.slices == NULL)
+		goto fail_frontier;
+
+	gtbs.opts = opts;
+	gtbs.nthread = threads;
+	gtbs.round = 1;
+
+	for (i = 0; i < threads; i++) {
+		gtbs.thread[i].gtbs = &gtbs;
+		gtbs.thread[i].id = i;
+		gtbs.thread[i].cpu = opts->pin || opts->placement != GENTB_PLACE_DEFAULT
+		    ? thread_cpu(i) : -1;
+		gtbs.thread[i].node = cpu_node(gtbs.thread[i].cpu);
+	}
+
+	/* place the memory before anything else touches it */
+	if (opts->placement != GENTB_PLACE_DEFAULT && place_memory(&gtbs) != 0)
+		goto fail_slices;
+
+	if (opts->resume != NULL) {
+		if (read_checkpoint(&gtbs, opts->resume) != 0)
+			goto fail_slices;
+
+		if (opts->algorithm == GENTB_COUNTER)
+			rebuild_counters(&gtbs);
+	}
+
+	gtbs.last_checkpoint = time(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &gtbs.round_start);
+	reset_deques(&gtbs);
+	fprintf(stderr, "Round %2u: ", gtbs.round);
 
 	for (i = 0; i < threads; i++) {
-		error = pthread_create(pool + i, NULL, gentb_worker, (void*)&gtbs);
+		error = pthread_create(pool + i, NULL, gentb_worker, (void*)(gtbs.thread + i));
 		/* try to cleanup as much as possible */
 		if (error != 0) {
 			for (j = 0; j < i; j++)
@@ -127,9 +373,8 @@ generate_tablebase(int threads)
 			for (j = 0; j < i; j++)
 				pthread_join(pool[j], NULL);
 
-			free(gtbs.tb);
 			errno = error;
-			return (NULL);
+			goto fail_slices;
 		}
 	}
 
@@ -137,13 +382,36 @@ generate_tablebase(int threads)
 	for (i = 0; i < threads; i++)
 		pthread_join(pool[i], NULL);
 
-	/* print final statistics */
-	fprintf(stderr, "%9u  %9u\n", gtbs.win, gtbs.loss);
-
-	/* this is fast enough to do synchronously */
-	count_wdl(gtbs.tb);
-
-	return (gtbs.tb);
+	free(gtbs.slices);
+	free((void*)gtbs.frontier);
+	free((void*)gtbs.next);
+	free((void*)gtbs.counters);
+	pthread_barrier_destroy(&gtbs.round_barrier);
+
+	finish_tablebase(tb, gtbs.table.won, gtbs.table.lost, gtbs.round, gtbs.loss != 0);
+	free((void*)gtbs.table.won);
+	free((void*)gtbs.table.lost);
+
+	return (tb);
+
+fail_slices:
+	error = errno;
+	free(gtbs.slices);
+	errno = error;
+fail_frontier:
+	error = errno;
+	free((void*)gtbs.table.won);
+	free((void*)gtbs.table.lost);
+	free((void*)gtbs.frontier);
+	free((void*)gtbs.next);
+	free((void*)gtbs.counters);
+	free_positions(tb);
+	errno = error;
+fail_tb:
+	free(tb);
+fail_barrier:
+	pthread_barrier_destroy(&gtbs.round_barrier);
+	return (NULL);
 }
 
 /*
@@ -152,101 +420,613 @@ generate_tablebase(int threads)
  * general process.
  */
 static void *
-gentb_worker(void *gtbs_arg)
+gentb_worker(void *gtt_arg)
 {
-	struct gentb_state *gtbs = gtbs_arg;
-	poscode pc;
-	unsigned round = 1, win = 0, loss = 0, print_stats;
+	struct gentb_thread *gtt = gtt_arg;
+	struct gentb_state *gtbs = gtt->gtbs;
+	struct gentb_stats stats;
+	size_t slice;
 	int error;
 
-	for (;;) {
-		print_stats = 0;
-
-		error = pthread_mutex_lock(&gtbs->lock);
-		assert(error == 0);
-
-		/* are we the first thread to open a new round? */
-		if (round > gtbs->round) {
-			/*
-			 * if we open a round, that means we either just
-			 * waited on round_barrier or we are the first
-			 * thread to run, so we can't have done any work
-			 * before.
-			 */
-			assert(win == 0 && loss == 0);
-
-			win = gtbs->win;
-			loss = gtbs->loss;
-			print_stats = 1;
-
-			/* are we completely done? */
-			if (loss == 0 && gtbs->round > 0) {
-				error = pthread_mutex_unlock(&gtbs->lock);
-				assert(error == 0);
-				break;
-			}
-
-			++gtbs->round;
-			gtbs->win = 0;
-			gtbs->loss = 0;
-			gtbs->pc.ownership = 0;
-			gtbs->pc.cohort = 0;
-		} else {
-			/* report results from previous chunk of work */
-			gtbs->win += win;
-			gtbs->loss += loss;
+	if (gtt->cpu >= 0 && pin_thread(gtt->cpu) != 0)
+		perror("pin_thread");
+
+	while (!gtbs->done) {
+		while (take_slice(gtbs, gtt->id, &slice)) {
+			memset(&stats, 0, sizeof stats);
+			if (gtbs->opts->algorithm == GENTB_FORWARD && gtbs->phase == 0)
+				forward_loss_slice(&gtbs->table, gtbs->frontier, gtbs->next,
+				    gtbs->slices + slice, &stats, gtbs->round);
+			else if (gtbs->opts->algorithm == GENTB_FORWARD)
+				forward_win_slice(&gtbs->table, gtbs->frontier, gtbs->next,
+				    gtbs->slices + slice, &stats, gtbs->round);
+			else if (gtbs->round == 1)
+				initial_round_slice(&gtbs->table, gtbs->next, gtbs->counters,
+				    gtbs->slices + slice, &stats);
+			else
+				normal_round_slice(&gtbs->table, gtbs->frontier, gtbs->next,
+				    gtbs->counters, gtbs->slices + slice, &stats, gtbs->round);
+
+			add_stats(&gtt->stats, &stats);
 		}
 
-		assert(round == gtbs->round);
-
-		/* any work left to do? */
-		if (gtbs->pc.ownership == OWNERSHIP_TOTAL_COUNT) {
-			/* wait for more work */
-			error = pthread_mutex_unlock(&gtbs->lock);
-			assert(error == 0);
-			error = pthread_barrier_wait(&gtbs->round_barrier);
-			assert(error == 0 || error == PTHREAD_BARRIER_SERIAL_THREAD);
-			round++;
-			win = loss = 0;
-			continue;
+		clock_gettime(CLOCK_MONOTONIC, &gtt->idle);
+		error = pthread_barrier_wait(&gtbs->round_barrier);
+		assert(error == 0 || error == PTHREAD_BARRIER_SERIAL_THREAD);
+		if (error == PTHREAD_BARRIER_SERIAL_THREAD)
+			finish_round(gtbs);
+
+		/* wait for finish_round() to complete */
+		error = pthread_barrier_wait(&gtbs->round_barrier);
+		assert(error == 0 || error == PTHREAD_BARRIER_SERIAL_THREAD);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Take a slice of work for thread id, stealing it from another thread
+ * if the thread's own deque is empty.  Store the index of the slice in
+ * *slice and return 1 on success, return 0 if no slices are left in
+ * this round.  As no slices are added to the deques during a round, a
+ * deque once found empty remains empty for the rest of the round.
+ * Threads on the same NUMA node are stolen from first as their slices
+ * are likely in memory local to us (see place_memory()).
+ */
+static int
+take_slice(struct gentb_state *gtbs, int id, size_t *slice)
+{
+	atomic_ullong *deque;
+	unsigned long long range, first, last;
+	int i, victim, pass;
+
+	/* take from the front of our own deque */
+	deque = &gtbs->thread[id].deque;
+	range = atomic_load(deque);
+	for (;;) {
+		first = range & 0xffffffffULL;
+		last = range >> 32;
+		if (first == last)
+			break;
+
+		if (atomic_compare_exchange_strong(deque, &range, last << 32 | (first + 1))) {
+			*slice = first;
+			return (1);
 		}
+	}
+
+	/* steal from the back of other threads' deques, same node first */
+	for (pass = 0; pass < 2; pass++)
+		for (i = 1; i < gtbs->nthread; i++) {
+			victim = (id + i) % gtbs->nthread;
+			if ((gtbs->thread[victim].node == gtbs->thread[id].node) != (pass == 0))
+				continue;
 
-		/* take work from gtbs */
-		pc = gtbs->pc;
-		gtbs->pc.cohort++;
-		if (gtbs->pc.cohort == COHORT_COUNT) {
-			gtbs->pc.cohort = 0;
-			gtbs->pc.ownership++;
+			deque = &gtbs->thread[victim].deque;
+			range = atomic_load(deque);
+			for (;;) {
+				first = range & 0xffffffffULL;
+				last = range >> 32;
+				if (first == last)
+					break;
+
+				if (atomic_compare_exchange_strong(deque, &range,
+				    (last - 1) << 32 | first)) {
+					*slice = last - 1;
+					return (1);
+				}
+			}
 		}
 
-		error = pthread_mutex_unlock(&gtbs->lock);
-		assert(error == 0);
+	return (0);
+}
 
-		/*
-		 * do costly IO after releasing the mutex to keep the
-		 * duration we hold the mutex for as short as possible.
-		 */
-		if (print_stats) {
-			if (round > 1)
-				fprintf(stderr, "%9u  %9u\n", win, loss);
+/*
+ * Finish the current round: sum up and print the number of positions
+ * the threads found and prepare the next round.  This is called by one
+ * thread while all other threads are waiting on round_barrier.  In
+ * forward mode, this is also called after phase 0 and just starts
+ * phase 1 unless no lost positions were found.
+ */
+static void
+finish_round(struct gentb_state *gtbs)
+{
+	struct gentb_stats total;
+	struct timespec now;
+	atomic_ulong *frontier;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	memset(&total, 0, sizeof total);
+	for (i = 0; i < gtbs->nthread; i++)
+		add_stats(&total, &gtbs->thread[i].stats);
+
+	if (gtbs->opts->algorithm == GENTB_FORWARD && gtbs->phase == 0 && total.loss != 0) {
+		/* the positions won in round moves have been counted */
+		memset((void*)gtbs->frontier, 0, FRONTIER_WORDS * sizeof *gtbs->frontier);
+		gtbs->phase = 1;
+		reset_deques(gtbs);
+		return;
+	}
+
+	gtbs->phase = 0;
+	gtbs->win = total.win;
+	gtbs->loss = total.loss;
+
+	fprintf(stderr, "%9u  %9u\n", gtbs->win, gtbs->loss);
+
+	if (gtbs->opts->telemetry != NULL)
+		write_telemetry(gtbs, &total, &now);
+
+	for (i = 0; i < gtbs->nthread; i++)
+		memset(&gtbs->thread[i].stats, 0, sizeof gtbs->thread[i].stats);
+
+	/* are we completely done? */
+	if (gtbs->loss == 0
+	    || (gtbs->opts->max_rounds != 0 && gtbs->round >= gtbs->opts->max_rounds)) {
+		gtbs->done = 1;
+		return;
+	}
+
+	gtbs->round++;
+
+	/* positions marked last round are now due */
+	if (gtbs->opts->algorithm != GENTB_FORWARD) {
+		frontier = gtbs->next;
+		gtbs->next = gtbs->frontier;
+		gtbs->frontier = frontier;
+	}
+
+	memset((void*)gtbs->next, 0, FRONTIER_WORDS * sizeof *gtbs->next);
+
+	if (gtbs->opts->checkpoint != NULL
+	    && time(NULL) - gtbs->last_checkpoint >= (time_t)gtbs->opts->checkpoint_interval) {
+		if (write_checkpoint(gtbs, gtbs->opts->checkpoint) != 0)
+			perror("write_checkpoint");
+
+		gtbs->last_checkpoint = time(NULL);
+	}
+
+	reset_deques(gtbs);
+	fprintf(stderr, "Round %2u: ", gtbs->round);
+	clock_gettime(CLOCK_MONOTONIC, &gtbs->round_start);
+}
+
+/*
+ * Write telemetry for the round just finished as one line of JSON to
+ * opts->telemetry.  total is the sum of the threads' statistics, now
+ * the time at which the round ended.  For each thread, idle is the
+ * time it spent waiting for the other threads to finish the round.
+ */
+static void
+write_telemetry(const struct gentb_state *gtbs, const struct gentb_stats *total,
+    const struct timespec *now)
+{
+	FILE *f = gtbs->opts->telemetry;
+	int i;
+
+	fprintf(f, "{\"round\": %u, \"threads\": %d, \"wall\": %.6f, "
+	    "\"win\": %u, \"loss\": %u, \"scanned\": %llu, \"frontier\": %llu, "
+	    "\"unmoves\": %llu, \"encodes\": %llu, \"atomics\": %llu, \"idle\": [",
+	    gtbs->round, gtbs->nthread, elapsed(&gtbs->round_start, now),
+	    total->win, total->loss, total->scanned, total->frontier,
+	    total->unmoves, total->encodes, total->atomics);
+
+	for (i = 0; i < gtbs->nthread; i++)
+		fprintf(f, "%s%.6f", i > 0 ? ", " : "", elapsed(&gtbs->thread[i].idle, now));
+
+	fprintf(f, "]}\n");
+	fflush(f);
+}
+
+/*
+ * Add the statistics in b to a.
+ */
+static void
+add_stats(struct gentb_stats *a, const struct gentb_stats *b)
+{
+
+	a->win += b->win;
+	a->loss += b->loss;
+	a->scanned += b->scanned;
+	a->frontier += b->frontier;
+	a->unmoves += b->unmoves;
+	a->encodes += b->encodes;
+	a->atomics += b->atomics;
+}
 
-			fprintf(stderr, "Round %2u: ", round);
+/*
+ * Return the number of seconds from start to end.
+ */
+static double
+elapsed(const struct timespec *start, const struct timespec *end)
+{
+
+	return ((end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/*
+ * Distribute all slices evenly among the threads' deques.
+ */
+static void
+reset_deques(struct gentb_state *gtbs)
+{
+	size_t first, last;
+	int i;
+
+	for (i = 0; i < gtbs->nthread; i++) {
+		thread_slices(gtbs, i, &first, &last);
+		gtbs->thread[i].deque = (unsigned long long)last << 32 | first;
+	}
+}
+
+/*
+ * Store the range of slices thread id is assigned at the beginning of
+ * each round in *first and *last (exclusive).
+ */
+static void
+thread_slices(const struct gentb_state *gtbs, int id, size_t *first, size_t *last)
+{
+
+	*first = gtbs->nslice * id / gtbs->nthread;
+	*last = gtbs->nslice * (id + 1) / gtbs->nthread;
+}
+
+/*
+ * Split the encoding space into slices as described in the comment
+ * for struct gentb_slice.  Chunks without valid ownership are skipped
+ * as they contain no positions.  Return an array of slices and store
+ * its length in *nslice.  On failure, return NULL.
+ */
+static struct gentb_slice *
+make_slices(size_t *nslice)
+{
+	struct gentb_slice *slices = NULL;
+	poscode pc;
+	size_t n;
+	unsigned first, chunksize;
+
+	/* first count the slices, then fill them in */
+	for (;;) {
+		n = 0;
+		for (pc.ownership = 0; pc.ownership < OWNERSHIP_TOTAL_COUNT; pc.ownership++)
+			for (pc.cohort = 0; pc.cohort < COHORT_COUNT; pc.cohort++) {
+				if (!has_valid_ownership(pc))
+					continue;
+
+				chunksize = cohort_size[pc.cohort].size * LIONPOS_COUNT;
+				for (first = 0; first < chunksize; first += GENTB_SLICE_SIZE) {
+					if (slices != NULL) {
+						slices[n].ownership = pc.ownership;
+						slices[n].cohort = pc.cohort;
+						slices[n].first = first;
+						slices[n].last = chunksize - first > GENTB_SLICE_SIZE
+						    ? first + GENTB_SLICE_SIZE : chunksize;
+					}
+
+					n++;
+				}
+			}
+
+		if (slices != NULL)
+			break;
+
+		slices = malloc(n * sizeof *slices);
+		if (slices == NULL)
+			return (NULL);
+	}
+
+	/* visit the tablebase in memory order */
+	qsort(slices, n, sizeof *slices, compare_slices);
+
+	*nslice = n;
+	return (slices);
+}
+
+/*
+ * Order two slices by their position in the tablebase.
+ */
+static int
+compare_slices(const void *a, const void *b)
+{
+	size_t oa = slice_offset(a), ob = slice_offset(b);
+
+	return ((oa > ob) - (oa < ob));
+}
+
+/*
+ * Return the offset of the first position of slice.
+ */
+static size_t
+slice_offset(const struct gentb_slice *slice)
+{
+	poscode pc;
+
+	pc.ownership = slice->ownership;
+	pc.cohort = slice->cohort;
+	pc.lionpos = pc.map = 0;
+
+	return (position_offset(pc) + slice->first);
+}
+
+/*
+ * Place the memory of the tablebase under construction as requested by
+ * opts->placement.  Pages are placed on the NUMA node of the thread
+ * first touching them, so one thread per generator thread is started
+ * on the CPU that generator thread is pinned to and touches its share
+ * of the memory.  With GENTB_PLACE_LOCAL, a thread's share is the
+ * memory for the slices it is assigned at the beginning of each round
+ * (see thread_slices()) and take_slice() prefers to steal from threads
+ * on the same node, so most work is done on local memory.  Return 0 on
+ * success, -1 on failure with errno set.
+ */
+static int
+place_memory(struct gentb_state *gtbs)
+{
+	pthread_t pool[GENTB_MAX_THREADS];
+	int i, error;
+
+	for (i = 0; i < gtbs->nthread; i++) {
+		error = pthread_create(pool + i, NULL, place_worker, (void*)(gtbs->thread + i));
+		if (error != 0) {
+			while (i-- > 0)
+				pthread_join(pool[i], NULL);
+
+			errno = error;
+			return (-1);
 		}
+	}
 
-		/* do the work we have taken */
-		win = loss = 0;
-		if (!has_valid_ownership(pc))
-			continue;
+	for (i = 0; i < gtbs->nthread; i++)
+		pthread_join(pool[i], NULL);
+
+	return (0);
+}
+
+/*
+ * Touch the share of the memory of one thread for place_memory().  The
+ * shares of the threads under GENTB_PLACE_LOCAL cover the encoding
+ * space from the first position of their first slice to the first
+ * position of the next thread's first slice, so the gaps left by
+ * chunks without valid ownership are covered, too.
+ */
+static void *
+place_worker(void *gtt_arg)
+{
+	struct gentb_thread *gtt = gtt_arg;
+	struct gentb_state *gtbs = gtt->gtbs;
+	struct gentb_table *gt = &gtbs->table;
+	size_t first, last, lo, hi;
+	int n = gtbs->nthread;
+
+	/* errors are reported by gentb_worker() */
+	if (gtt->cpu >= 0)
+		pin_thread(gtt->cpu);
+
+	if (gtbs->opts->placement == GENTB_PLACE_INTERLEAVE) {
+		touch_interleaved(gt->tb->positions, POSITION_COUNT, gtt->id, n);
+		touch_interleaved(gt->won, UNSTORED_WORDS * sizeof *gt->won, gtt->id, n);
+		touch_interleaved(gt->lost, UNSTORED_WORDS * sizeof *gt->lost, gtt->id, n);
+		touch_interleaved(gtbs->frontier, FRONTIER_WORDS * sizeof *gtbs->frontier, gtt->id, n);
+		touch_interleaved(gtbs->next, FRONTIER_WORDS * sizeof *gtbs->next, gtt->id, n);
+		if (gtbs->counters != NULL)
+			touch_interleaved(gtbs->counters, POSITION_TOTAL_COUNT, gtt->id, n);
+
+		return (NULL);
+	}
+
+	thread_slices(gtbs, gtt->id, &first, &last);
+	lo = gtt->id == 0 ? 0 : slice_offset(gtbs->slices + first);
+	hi = gtt->id == n - 1 ? POSITION_TOTAL_COUNT : slice_offset(gtbs->slices + last);
+	if (lo >= hi)
+		return (NULL);
+
+	if (lo < POSITION_COUNT)
+		touch_range(gt->tb->positions, lo, hi < POSITION_COUNT ? hi : POSITION_COUNT);
 
-		if (round == 1)
-			initial_round_chunk(gtbs->tb, pc, &win, &loss);
-		else
-			normal_round_chunk(gtbs->tb, pc, &win, &loss, round);
+	if (hi > POSITION_COUNT) {
+		first = lo > POSITION_COUNT ? (lo - POSITION_COUNT) / FRONTIER_WORD_BITS : 0;
+		last = hi == POSITION_TOTAL_COUNT ? UNSTORED_WORDS
+		    : (hi - POSITION_COUNT) / FRONTIER_WORD_BITS;
+		touch_range(gt->won, first * sizeof *gt->won, last * sizeof *gt->won);
+		touch_range(gt->lost, first * sizeof *gt->lost, last * sizeof *gt->lost);
 	}
 
+	first = lo / FRONTIER_WORD_BITS;
+	last = hi == POSITION_TOTAL_COUNT ? FRONTIER_WORDS : hi / FRONTIER_WORD_BITS;
+	touch_range(gtbs->frontier, first * sizeof *gtbs->frontier, last * sizeof *gtbs->frontier);
+	touch_range(gtbs->next, first * sizeof *gtbs->next, last * sizeof *gtbs->next);
+
+	if (gtbs->counters != NULL)
+		touch_range(gtbs->counters, lo, hi);
+
 	return (NULL);
 }
 
+/*
+ * Touch bytes lo to hi (exclusive) of the zero-initialized memory at
+ * base by clearing them.
+ */
+static void
+touch_range(volatile void *base, size_t lo, size_t hi)
+{
+
+	if (lo < hi)
+		memset((char*)base + lo, 0, hi - lo);
+}
+
+/*
+ * Touch every n-th block of PLACEMENT_BLOCK bytes of the size bytes of
+ * zero-initialized memory at base, starting with block id.
+ */
+static void
+touch_interleaved(volatile void *base, size_t size, int id, int n)
+{
+	size_t offset;
+
+	for (offset = (size_t)id * PLACEMENT_BLOCK; offset < size; offset += (size_t)n * PLACEMENT_BLOCK)
+		touch_range(base, offset, size - offset > PLACEMENT_BLOCK ? offset + PLACEMENT_BLOCK : size);
+}
+
+/*
+ * Write the state of the generator between two rounds to a checkpoint
+ * file named path.  The checkpoint is first written to a temporary
+ * file which is then renamed to path, so an existing checkpoint is
+ * only replaced once the new one is complete.  Return 0 on success,
+ * -1 on failure with errno set.
+ */
+static int
+write_checkpoint(const struct gentb_state *gtbs, const char *path)
+{
+	struct gentb_checkpoint gc;
+	FILE *f;
+	size_t len = strlen(path);
+	int error;
+	char *tmppath;
+
+	tmppath = malloc(len + sizeof ".tmp");
+	if (tmppath == NULL)
+		return (-1);
+
+	memcpy(tmppath, path, len);
+	memcpy(tmppath + len, ".tmp", sizeof ".tmp");
+
+	f = fopen(tmppath, "wb");
+	if (f == NULL) {
+		free(tmppath);
+		return (-1);
+	}
+
+	memset(&gc, 0, sizeof gc);
+	memcpy(gc.magic, checkpoint_magic, sizeof gc.magic);
+	gc.size = POSITION_TOTAL_COUNT;
+	gc.round = gtbs->round;
+	gc.win = gtbs->win;
+	gc.loss = gtbs->loss;
+
+	fwrite(&gc, sizeof gc, 1, f);
+	fwrite((void*)gtbs->table.tb->positions, POSITION_COUNT, 1, f);
+	fwrite((void*)gtbs->table.won, sizeof *gtbs->table.won, UNSTORED_WORDS, f);
+	fwrite((void*)gtbs->table.lost, sizeof *gtbs->table.lost, UNSTORED_WORDS, f);
+	fwrite((void*)gtbs->frontier, sizeof *gtbs->frontier, FRONTIER_WORDS, f);
+	fflush(f);
+
+	/* make sure the checkpoint is on disk before replacing the old one */
+	if (ferror(f) || fsync(fileno(f)) != 0) {
+		error = errno;
+		fclose(f);
+		goto fail;
+	}
+
+	if (fclose(f) != 0 || rename(tmppath, path) != 0) {
+		error = errno;
+		goto fail;
+	}
+
+	free(tmppath);
+	return (0);
+
+fail:
+	remove(tmppath);
+	free(tmppath);
+	errno = error;
+	return (-1);
+}
+
+/*
+ * Restore the state of the generator from the checkpoint file named
+ * path.  Return 0 on success, -1 on failure with errno set.  If the
+ * file is not a valid checkpoint, errno is set to EINVAL.
+ */
+static int
+read_checkpoint(struct gentb_state *gtbs, const char *path)
+{
+	struct gentb_checkpoint gc;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return (-1);
+
+	if (fread(&gc, sizeof gc, 1, f) != 1
+	    || memcmp(gc.magic, checkpoint_magic, sizeof gc.magic) != 0
+	    || gc.size != POSITION_TOTAL_COUNT || gc.round < 2)
+		goto invalid;
+
+	if (fread((void*)gtbs->table.tb->positions, POSITION_COUNT, 1, f) != 1
+	    || fread((void*)gtbs->table.won, sizeof *gtbs->table.won, UNSTORED_WORDS, f)
+	    != UNSTORED_WORDS
+	    || fread((void*)gtbs->table.lost, sizeof *gtbs->table.lost, UNSTORED_WORDS, f)
+	    != UNSTORED_WORDS
+	    || fread((void*)gtbs->frontier, sizeof *gtbs->frontier, FRONTIER_WORDS, f)
+	    != FRONTIER_WORDS
+	    || getc(f) != EOF)
+		goto invalid;
+
+	fclose(f);
+
+	gtbs->round = gc.round;
+	gtbs->win = gc.win;
+	gtbs->loss = gc.loss;
+
+	return (0);
+
+invalid:
+	fclose(f);
+	errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * The counters are not part of a checkpoint.  Recompute them by
+ * counting the moves of each position not yet decided that do not lead
+ * to a position won in less than round moves.  Positions won in round
+ * moves are still counted as they are processed in this round.
+ */
+static void
+rebuild_counters(struct gentb_state *gtbs)
+{
+	struct gentb_stats stats;
+	struct position p, pmirror;
+	struct move moves[MAX_MOVES];
+	struct move_encoder me;
+	poscode pc, pppc;
+	size_t i, j, nmove, offset, base, size;
+	unsigned count;
+
+	memset(&stats, 0, sizeof stats);
+	for (i = 0; i < gtbs->nslice; i++) {
+		pc.ownership = gtbs->slices[i].ownership;
+		pc.cohort = gtbs->slices[i].cohort;
+		pc.lionpos = pc.map = 0;
+		base = position_offset(pc);
+		size = cohort_size[pc.cohort].size;
+
+		for (offset = base + gtbs->slices[i].first; offset < base + gtbs->slices[i].last; offset++) {
+			if (is_decided(&gtbs->table, offset))
+				continue;
+
+			pc.lionpos = (offset - base) / size;
+			pc.map = (offset - base) % size;
+			decode_poscode(&p, pc);
+			prepare_encoder(&me, &p);
+			nmove = generate_legal_moves(moves, &p);
+			count = 0;
+			for (j = 0; j < nmove; j++) {
+				encode_move(&pppc, &me, &p, moves + j);
+				if (!won_within(&gtbs->table, gtbs->frontier,
+				    position_offset(pppc), gtbs->round - 1))
+					count++;
+			}
+
+			pmirror = p;
+			gtbs->counters[class_offset(&p, offset, &stats)]
+			    += position_mirror(&pmirror) ? count : 2 * count;
+		}
+	}
+}
+
 /*
  * In the initial round, every positions in the tablebase is evaluated.
  * Positions are categorized as:
@@ -255,54 +1035,92 @@ gentb_worker(void *gtbs_arg)
  *  - checkmates (-1) if for each possible move sente_in_check() holds.
  *    This includes stalemates.
  *  - mate-in-one positions (2) if a checkmate can be reached.
+ *
+ * Mate-in-one positions are recorded in the bitmap next.  If counters
+ * is not NULL, the number of legal moves of every other position is
+ * added to its counter, see counter_round_pos().
  */
 static void
-initial_round_chunk(struct tablebase *tb, poscode pc, unsigned *win, unsigned *loss)
+initial_round_slice(struct gentb_table *gt, atomic_ulong *next, atomic_uchar *counters,
+    const struct gentb_slice *slice, struct gentb_stats *stats)
 {
-	unsigned size = cohort_size[pc.cohort].size;
+	struct poscode_decoder pd;
+	poscode pc;
+	unsigned i, size = cohort_size[slice->cohort].size;
+
+	pc.ownership = slice->ownership;
+	pc.cohort = slice->cohort;
+	pc.lionpos = slice->first / size;
+	pc.map = slice->first % size;
 
-	for (pc.lionpos = 0; pc.lionpos < LIONPOS_COUNT; pc.lionpos++)
-		for (pc.map = 0; pc.map < size; pc.map++)
-			initial_round_pos(tb, pc, win, loss);
+	stats->scanned += slice->last - slice->first;
+	stats->frontier += slice->last - slice->first;
+
+	start_decoder(&pd, pc);
+	for (i = slice->first; i < slice->last; i++) {
+		initial_round_pos(gt, next, counters, &pd, stats);
+		next_poscode(&pd);
+	}
 }
 
 /*
- * For the initial round, evaluate one position indicated by pc and
- * store the result in tb.  Also increment win1 and loss1 if an
- * immediate win or checkmate is encountered.
+ * For the initial round, evaluate the position pd has decoded last and
+ * store the result in gt.  Also increment stats->win and stats->loss
+ * if an immediate win or checkmate is encountered.
  */
 static void
-initial_round_pos(struct tablebase *tb, poscode pc, unsigned *win1, unsigned *loss1)
+initial_round_pos(struct gentb_table *gt, atomic_ulong *next, atomic_uchar *counters,
+    const struct poscode_decoder *pd, struct gentb_stats *stats)
 {
-	struct position p;
+	const struct position p = pd->p;
 	struct unmove unmoves[MAX_UNMOVES];
 	struct move moves[MAX_MOVES];
-	size_t i, nmove, offset = position_offset(pc);
+	struct position pmirror;
+	poscode pc;
+	size_t i, nmove, offset = position_offset(pd->pc), moffset;
 	int game_ended;
 
-	decode_poscode(&p, pc);
 	if (gote_in_check(&p)) {
-		tb->positions[offset] = 1;
-		++*win1;
+		set_entry(gt, offset, 1);
+		stats->win++;
 		return;
 	}
 
-	nmove = generate_moves(moves, &p);
-	for (i = 0; i < nmove; i++) {
-		struct position pp = p;
-		game_ended = play_move(&pp, moves + i);
-		assert(!game_ended);
+	if (counters != NULL) {
+		nmove = generate_legal_moves(moves, &p);
+		if (nmove != 0) {
+			/* the counter is shared with the mirrored position */
+			pmirror = p;
+			if (position_mirror(&pmirror)) {
+				encode_position(&pc, &pmirror);
+				moffset = position_offset(pc);
+				atomic_fetch_add(counters + (moffset < offset ? moffset : offset), nmove);
+				stats->encodes++;
+				stats->atomics++;
+			} else
+				counters[offset] = 2 * nmove;
 
-		if (!sente_in_check(&pp)) {
-			/* position is not an immediate loss, can't judge it */
 			return;
 		}
+	} else {
+		nmove = generate_moves(moves, &p);
+		for (i = 0; i < nmove; i++) {
+			struct position pp = p;
+			game_ended = play_move(&pp, moves + i);
+			assert(!game_ended);
+
+			if (!sente_in_check(&pp)) {
+				/* position is not an immediate loss, can't judge it */
+				return;
+			}
+		}
 	}
 
 	/* all moves lead to a win for Gote */
-	tb->positions[offset] = -1;
-	++*loss1;
+	set_entry(gt, offset, -1);
+	stats->loss++;
 	nmove = generate_unmoves(unmoves, &p);
+	stats->unmoves += nmove;
 	for (i = 0; i < nmove; i++) {
 		struct position pp = p;
 
@@ -313,7 +1131,7 @@ initial_round_pos(struct tablebase *tb, poscode pc, unsigned *win1, unsigned *lo
 		 * positions that are also mate in 1.
 		 */
 		if (!sente_in_check(&pp))
-			mark_position(tb, &pp, 2);
+			mark_position(gt, next, &pp, 2, stats);
 	}
 }
 
@@ -323,122 +1141,501 @@ initial_round_pos(struct tablebase *tb, poscode pc, unsigned *win1, unsigned *lo
  * each position we find this way, we check if it's a losing position.
  * If it is, we mark the position as "lost" with the appropriate
  * distance to mate and every position reachable unmarked positions from
- * this as "won" with the appropriate distance to mate. If any positions
- * were marked in this last phase, nonzero is returned, zero otherwise.
+ * this as "won" with the appropriate distance to mate.  The positions
+ * to examine are taken from the bitmap frontier, positions marked as
+ * won are recorded in next.  If counters is not NULL, the losing
+ * positions are found with counter_round_pos() instead.
  */
 static void
-normal_round_chunk(struct tablebase *tb, poscode pc, unsigned *win, unsigned *loss, unsigned round)
+normal_round_slice(struct gentb_table *gt, const atomic_ulong *frontier, atomic_ulong *next,
+    atomic_uchar *counters, const struct gentb_slice *slice, struct gentb_stats *stats,
+    unsigned round)
 {
-	unsigned size = cohort_size[pc.cohort].size;
+	poscode pc;
+	size_t offset, base, end, size = cohort_size[slice->cohort].size;
+	unsigned long word;
+
+	pc.ownership = slice->ownership;
+	pc.cohort = slice->cohort;
+	pc.lionpos = pc.map = 0;
+	base = position_offset(pc);
+	end = base + slice->last;
+	stats->scanned += slice->last - slice->first;
+
+	for (offset = base + slice->first; offset < end; offset++) {
+		word = frontier[offset / FRONTIER_WORD_BITS] >> offset % FRONTIER_WORD_BITS;
+
+		/* skip to the next word if no bits are left in this one */
+		if (word == 0) {
+			offset |= FRONTIER_WORD_BITS - 1;
+			continue;
+		}
 
-	for (pc.lionpos = 0; pc.lionpos < LIONPOS_COUNT; pc.lionpos++)
-		for (pc.map = 0; pc.map < size; pc.map++)
-			normal_round_pos(tb, pc, round, win, loss);
+		if (word & 1) {
+			pc.lionpos = (offset - base) / size;
+			pc.map = (offset - base) % size;
+			stats->frontier++;
+			if (counters != NULL)
+				counter_round_pos(gt, next, counters, pc, round, stats);
+			else
+				normal_round_pos(gt, next, pc, round, stats);
+		}
+	}
 }
 
 /*
  * Process one position in a normal round.
  */
 static void
-normal_round_pos(struct tablebase *tb, poscode pc, int round,
-    unsigned *wins, unsigned *losses)
+normal_round_pos(struct gentb_table *gt, atomic_ulong *next, poscode pc, int round,
+    struct gentb_stats *stats)
 {
 	struct position p;
+	struct xposition xp;
+	struct move_encoder me;
 	struct unmove unmoves[MAX_UNMOVES];
-	size_t i, nunmove;
+	size_t i, nunmove, offset;
 
-	if (tb->positions[position_offset(pc)] != round)
+	/* only stored positions record the round they were won in */
+	offset = position_offset(pc);
+	if (offset < POSITION_COUNT && gt->tb->positions[offset] != round)
 		return;
 
-	++*wins;
+	stats->win++;
 
 	decode_poscode(&p, pc);
+	extend_position(&xp, &p);
+	prepare_encoder(&me, &p);
 	nunmove = generate_unmoves(unmoves, &p);
+	stats->unmoves += nunmove;
 	for (i = 0; i < nunmove; i++) {
 		/* check if this is indeed a losing position */
-		struct position ppmirror, pp = p;
+		struct xposition xpp;
+		struct move_encoder ppme;
 		poscode pc;
-		struct unmove ununmoves[MAX_UNMOVES];
 		struct move moves[MAX_MOVES];
-		tb_entry value;
-		size_t j, nununmove, nmove, offset;
-		int game_ends;
-
-		undo_move(&pp, unmoves + i);
+		struct check_info ci;
+		size_t j, nmove;
 
 		/* have we already analyzed this position? */
-		encode_position(&pc, &pp);
+		encode_unmove(&pc, &me, &p, unmoves + i);
+		stats->encodes++;
 		if (pc.lionpos >= LIONPOS_COUNT)
 			continue;
 
 		offset = position_offset(pc);
-		if (tb->positions[offset] != 0)
+		if (is_decided(gt, offset))
 			continue;
 
-		/* make sure all moves are losing */
-		nmove = generate_moves(moves, &pp);
+		xpp = xp;
+		xundo_move(&xpp, unmoves + i);
+		prepare_encoder(&ppme, &xpp.p);
+
+		/*
+		 * make sure all moves are losing.  Moves into check are
+		 * weeded out without playing them.
+		 */
+		nmove = generate_moves(moves, &xpp.p);
+		prepare_checks(&ci, &xpp);
 		for (j = 0; j < nmove; j++) {
-			struct position ppp = pp;
 			poscode pppc;
 
-			game_ends = play_move(&ppp, moves + j);
-			assert(!game_ends);
-			assert(!gote_moves(&ppp));
-			if (gote_in_check(&ppp))
+			if (move_into_check(&ci, &xpp.p, moves + j))
 				continue;
 
-			encode_position(&pppc, &ppp);
-			value = tb->positions[position_offset(pppc)];
-			if (!is_win(value) || value > round)
+			encode_move(&pppc, &ppme, &xpp.p, moves + j);
+			stats->encodes++;
+			if (!won_within(gt, next, position_offset(pppc), round))
 				goto not_a_losing_position;
 		}
 
-		/* all moves are losing, mark positions as lost */
-		value = atomic_exchange(tb->positions + offset, -round);
-		assert(value == 0 || value == -round);
-		if (value == 0)
-			++*losses;
-
-		ppmirror = pp;
-		if (position_mirror(&ppmirror)) {
-			encode_position(&pc, &ppmirror);
-			offset = position_offset(pc);
-			value = atomic_exchange(tb->positions + offset, -round);
-			assert(value == 0 || value == -round);
-			if (value == 0)
-				++*losses;
-		}
+		/* all moves are losing */
+		mark_loss(gt, next, &xpp, offset, round, stats);
 
-		/* mark all positions reachable from this one as won */
-		nununmove = generate_unmoves(ununmoves, &pp);
-		for (j = 0; j < nununmove; j++) {
-			struct position ppp = pp;
+	not_a_losing_position:
+		;
+	}
+}
 
-			undo_move(&ppp, ununmoves + j);
+/*
+ * Process one position in a normal round with the counter algorithm.
+ * The counter of a position not yet decided holds the number of its
+ * moves not into check that have not been found to lead to a position
+ * won for the opponent.  Each unmove of a position won in round moves
+ * accounts for such a move, so its predecessor's counter is
+ * decremented and once it reaches zero, the predecessor is lost in
+ * round moves.  No moves have to be generated to verify this.
+ *
+ * Mirroring complicates this.  The two poscodes of a position with both
+ * lions on the B file share the counter at the smaller offset of the
+ * two (see class_offset()), which holds the sum for both.  Every other
+ * position has only one poscode for itself and its mirror image and
+ * its counter holds twice the number of its moves, counting those of
+ * the mirror image, too.  An unmove of such a position stands for the
+ * corresponding unmove of its mirror image as well and thus counts
+ * twice.  This way, each move is accounted for exactly once.
+ */
+static void
+counter_round_pos(struct gentb_table *gt, atomic_ulong *next, atomic_uchar *counters, poscode pc,
+    int round, struct gentb_stats *stats)
+{
+	struct position p;
+	struct xposition xp, xpp;
+	struct move_encoder me;
+	struct unmove unmoves[MAX_UNMOVES];
+	size_t i, nunmove, offset;
+	unsigned count, weight;
 
-			if (!gote_in_check(&ppp))
-				mark_position(tb, &ppp, round + 1);
-		}
+	offset = position_offset(pc);
+	if (offset < POSITION_COUNT && gt->tb->positions[offset] != round)
+		return;
 
-	not_a_losing_position:
-		;
+	stats->win++;
+
+	decode_poscode(&p, pc);
+	xp.p = p;
+	weight = position_mirror(&xp.p) ? 1 : 2;
+	extend_position(&xp, &p);
+	prepare_encoder(&me, &p);
+	nunmove = generate_unmoves(unmoves, &p);
+	stats->unmoves += nunmove;
+	for (i = 0; i < nunmove; i++) {
+		encode_unmove(&pc, &me, &p, unmoves + i);
+		stats->encodes++;
+		if (pc.lionpos >= LIONPOS_COUNT)
+			continue;
+
+		offset = position_offset(pc);
+		if (is_decided(gt, offset))
+			continue;
+
+		xpp = xp;
+		xundo_move(&xpp, unmoves + i);
+		count = atomic_fetch_sub(counters + class_offset(&xpp.p, offset, stats), weight);
+		stats->atomics++;
+		assert(count >= weight);
+		if (count == weight)
+			mark_loss(gt, next, &xpp, offset, round, stats);
 	}
 }
 
 /*
- * Mark position p and its mirrored variant as e in tb if it hasn't been
- * marked before.
+ * Mark xpp, found at offset, and its mirrored variant as lost in round
+ * moves and all positions reachable from it as won in round + 1 moves.
+ * Record the latter in the bitmap next.
  */
 static void
-mark_position(struct tablebase *tb, const struct position *p, tb_entry e)
+mark_loss(struct gentb_table *gt, atomic_ulong *next, const struct xposition *xpp, size_t offset,
+    int round, struct gentb_stats *stats)
+{
+	struct position ppmirror;
+	struct unmove ununmoves[MAX_UNMOVES];
+	poscode pc;
+	size_t j, nununmove;
+
+	stats->loss += set_loss(gt, offset, -round);
+	stats->atomics++;
+
+	ppmirror = xpp->p;
+	if (position_mirror(&ppmirror)) {
+		encode_position(&pc, &ppmirror);
+		stats->loss += set_loss(gt, position_offset(pc), -round);
+		stats->encodes++;
+		stats->atomics++;
+	}
+
+	/* mark all positions reachable from this one as won */
+	nununmove = generate_unmoves(ununmoves, &xpp->p);
+	stats->unmoves += nununmove;
+	for (j = 0; j < nununmove; j++) {
+		struct xposition xppp = *xpp;
+
+		xundo_move(&xppp, ununmoves + j);
+
+		if (!xgote_in_check(&xppp))
+			mark_position(gt, next, &xppp.p, round + 1, stats);
+	}
+}
+
+/*
+ * Return the offset of the counter for position p found at offset,
+ * which is the smaller of the offsets of p and its mirrored variant.
+ */
+static size_t
+class_offset(const struct position *p, size_t offset, struct gentb_stats *stats)
+{
+	struct position pmirror = *p;
+	poscode pc;
+	size_t moffset;
+
+	if (!position_mirror(&pmirror))
+		return (offset);
+
+	encode_position(&pc, &pmirror);
+	stats->encodes++;
+	moffset = position_offset(pc);
+
+	return (moffset < offset ? moffset : offset);
+}
+
+/*
+ * Mark position p and its mirrored variant as e in gt if it hasn't been
+ * marked before.  Record newly marked positions in the bitmap next.
+ */
+static void
+mark_position(struct gentb_table *gt, atomic_ulong *next, const struct position *p, tb_entry e,
+    struct gentb_stats *stats)
 {
 	struct position pp = *p;
 	poscode pc;
-	size_t offset;
 
 	encode_position(&pc, &pp);
-	offset = position_offset(pc);
-	assert(tb->positions[offset] >= 0);
+	stats->encodes++;
+	if (!set_win(gt, next, position_offset(pc), e))
+		return;
+
+	stats->atomics++;
+	if (!position_mirror(&pp))
+		return;
+
+	encode_position(&pc, &pp);
+	stats->encodes++;
+	if (set_win(gt, next, position_offset(pc), e))
+		stats->atomics++;
+}
+
+/*
+ * In forward mode, each round n consists of two sweeps over the
+ * positions not yet decided, each looking only at their successors.
+ * In the first sweep, positions where all moves not into check lead to
+ * positions won in at most n moves are marked as lost in n moves and
+ * recorded in the bitmap changed.  In the first round, immediate wins
+ * are marked, too.  In the second sweep (forward_win_slice()),
+ * positions with a move to a position recorded in changed are marked
+ * as won in n + 1 moves and recorded in the bitmap frontier.  Each
+ * sweep only reads what the other one writes, so the threads need not
+ * synchronize within a sweep and the result is the same as that of the
+ * retrograde algorithm.  stats->win counts the positions won in n
+ * moves as normal_round_slice() does, taking them from the frontier
+ * the previous round left behind.
+ */
+static void
+forward_loss_slice(struct gentb_table *gt, const atomic_ulong *frontier, atomic_ulong *changed,
+    const struct gentb_slice *slice, struct gentb_stats *stats, unsigned round)
+{
+	struct position p;
+	poscode pc;
+	size_t offset, base, end, size = cohort_size[slice->cohort].size;
+	tb_entry e;
+
+	pc.ownership = slice->ownership;
+	pc.cohort = slice->cohort;
+	pc.lionpos = pc.map = 0;
+	base = position_offset(pc);
+	end = base + slice->last;
+	stats->scanned += slice->last - slice->first;
+
+	for (offset = base + slice->first; offset < end; offset++) {
+		if (test_bit(frontier, offset))
+			stats->win++;
+
+		if (is_decided(gt, offset))
+			continue;
+
+		pc.lionpos = (offset - base) / size;
+		pc.map = (offset - base) % size;
+		decode_poscode(&p, pc);
+		stats->frontier++;
+
+		e = forward_loss_pos(gt, &p, stats, round);
+		if (e == 0)
+			continue;
+
+		set_entry(gt, offset, e);
+		if (is_win(e))
+			stats->win++;
+		else {
+			set_bit(changed, offset);
+			stats->atomics++;
+			stats->loss++;
+		}
+	}
+}
+
+/*
+ * Return the value of p if it is lost in round moves or, in the first
+ * round, won immediately.  Otherwise return 0.
+ */
+static tb_entry
+forward_loss_pos(const struct gentb_table *gt, const struct position *p,
+    struct gentb_stats *stats, unsigned round)
+{
+	struct move moves[MAX_MOVES];
+	struct move_encoder me;
+	poscode pc;
+	size_t i, nmove;
+
+	if (round == 1 && gote_in_check(p))
+		return (1);
+
+	nmove = generate_legal_moves(moves, p);
+	if (nmove == 0)
+		return (-(tb_entry)round);
+
+	prepare_encoder(&me, p);
+	for (i = 0; i < nmove; i++) {
+		encode_move(&pc, &me, p, moves + i);
+		stats->encodes++;
+		if (!won_within(gt, NULL, position_offset(pc), round))
+			return (0);
+	}
+
+	return (-(tb_entry)round);
+}
+
+/*
+ * The second sweep of a round in forward mode, see
+ * forward_loss_slice().
+ */
+static void
+forward_win_slice(struct gentb_table *gt, atomic_ulong *frontier, const atomic_ulong *changed,
+    const struct gentb_slice *slice, struct gentb_stats *stats, unsigned round)
+{
+	struct position p;
+	poscode pc;
+	size_t offset, base, end, size = cohort_size[slice->cohort].size;
+
+	pc.ownership = slice->ownership;
+	pc.cohort = slice->cohort;
+	pc.lionpos = pc.map = 0;
+	base = position_offset(pc);
+	end = base + slice->last;
+	stats->scanned += slice->last - slice->first;
+
+	for (offset = base + slice->first; offset < end; offset++) {
+		if (is_decided(gt, offset))
+			continue;
+
+		pc.lionpos = (offset - base) / size;
+		pc.map = (offset - base) % size;
+		decode_poscode(&p, pc);
+		stats->frontier++;
+
+		if (forward_win_pos(changed, &p, stats)) {
+			set_entry(gt, offset, round + 1);
+			set_bit(frontier, offset);
+			stats->atomics++;
+		}
+	}
+}
+
+/*
+ * Return 1 if p has a move to a position recorded in changed, 0
+ * otherwise.
+ */
+static int
+forward_win_pos(const atomic_ulong *changed, const struct position *p, struct gentb_stats *stats)
+{
+	struct move moves[MAX_MOVES];
+	struct move_encoder me;
+	poscode pc;
+	size_t i, nmove;
+
+	nmove = generate_legal_moves(moves, p);
+	prepare_encoder(&me, p);
+	for (i = 0; i < nmove; i++) {
+		encode_move(&pc, &me, p, moves + i);
+		stats->encodes++;
+		if (test_bit(changed, position_offset(pc)))
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Return 1 if the position at offset has been decided, 0 otherwise.
+ */
+static int
+is_decided(const struct gentb_table *gt, size_t offset)
+{
+
+	if (offset < POSITION_COUNT)
+		return (gt->tb->positions[offset] != 0);
+
+	offset -= POSITION_COUNT;
+	return (test_bit(gt->won, offset) || test_bit(gt->lost, offset));
+}
+
+/*
+ * Return 1 if the position at offset is won in at most round moves, 0
+ * otherwise.  later is a bitmap of positions won in round + 1 moves or
+ * NULL if no position has been marked as such yet.
+ */
+static int
+won_within(const struct gentb_table *gt, const atomic_ulong *later, size_t offset,
+    tb_entry round)
+{
+	tb_entry e;
+
+	if (offset < POSITION_COUNT) {
+		e = gt->tb->positions[offset];
+		return (is_win(e) && e <= round);
+	}
+
+	if (!test_bit(gt->won, offset - POSITION_COUNT))
+		return (0);
+
+	if (later == NULL)
+		return (1);
+
+	/*
+	 * set_win() sets the bit in later first, so it must be loaded
+	 * after the bit in won.  atomic_load() keeps the two loads in
+	 * order even where atomic_ulong is just volatile.
+	 */
+	return (!(atomic_load((atomic_ulong *)later + offset / FRONTIER_WORD_BITS)
+	    >> offset % FRONTIER_WORD_BITS & 1));
+}
+
+/*
+ * Set the entry of the undecided position at offset to e.  No other
+ * thread may access the entry at the same time.
+ */
+static void
+set_entry(struct gentb_table *gt, size_t offset, tb_entry e)
+{
+
+	if (offset < POSITION_COUNT)
+		gt->tb->positions[offset] = e;
+	else
+		set_bit(is_win(e) ? gt->won : gt->lost, offset - POSITION_COUNT);
+}
+
+/*
+ * Mark the position at offset as won in e moves and record it in the
+ * bitmap next unless it has been decided before.  Return 1 if it was
+ * marked, 0 if not.
+ */
+static int
+set_win(struct gentb_table *gt, atomic_ulong *next, size_t offset, tb_entry e)
+{
+
+	if (offset >= POSITION_COUNT) {
+		assert(!test_bit(gt->lost, offset - POSITION_COUNT));
+		if (test_bit(gt->won, offset - POSITION_COUNT))
+			return (0);
+
+		/*
+		 * Only positions won in e moves are marked concurrently.
+		 * Set the bit in next first so won_within() never sees
+		 * the position as won in less than e moves.
+		 */
+		set_bit(next, offset);
+		return (!set_bit(gt->won, offset - POSITION_COUNT));
+	}
+
+	assert(gt->tb->positions[offset] >= 0);
 
 	/*
 	 * We only use this function to mark positions as won.  Thus,
@@ -446,72 +1643,197 @@ mark_position(struct tablebase *tb, const struct position *p, tb_entry e)
 	 * position as e and we don't have a test-and-set style race
 	 * condition.
 	 */
-	if (tb->positions[offset] != 0)
-		return;
+	if (gt->tb->positions[offset] != 0)
+		return (0);
 
-	tb->positions[offset] = e;
+	gt->tb->positions[offset] = e;
+	set_bit(next, offset);
 
-	if (!position_mirror(&pp))
-		return;
+	return (1);
+}
 
-	encode_position(&pc, &pp);
-	offset = position_offset(pc);
-	assert(tb->positions[offset] >= 0);
+/*
+ * Mark the position at offset as lost in -e moves.  Other threads
+ * might concurrently do the same.  Return 1 if the position was not
+ * marked before, 0 if it was.
+ */
+static int
+set_loss(struct gentb_table *gt, size_t offset, tb_entry e)
+{
+	tb_entry value;
 
-	if (tb->positions[offset] != 0)
-		return;
+	if (offset >= POSITION_COUNT)
+		return (!set_bit(gt->lost, offset - POSITION_COUNT));
+
+	value = atomic_exchange(gt->tb->positions + offset, e);
+	assert(value == 0 || value == e);
+
+	return (value == 0);
+}
+
+/*
+ * Return bit i of bitmap.
+ */
+static int
+test_bit(const atomic_ulong *bitmap, size_t i)
+{
+
+	return (bitmap[i / FRONTIER_WORD_BITS] >> i % FRONTIER_WORD_BITS & 1);
+}
+
+/*
+ * Atomically set bit i of bitmap and return its previous value.
+ */
+static int
+set_bit(atomic_ulong *bitmap, size_t i)
+{
+	unsigned long bit = 1UL << i % FRONTIER_WORD_BITS;
 
-	tb->positions[offset] = e;
+	return (!!(atomic_fetch_or(bitmap + i / FRONTIER_WORD_BITS, bit) & bit));
+}
+
+/*
+ * Finish the tablebase tb after generating it in rounds rounds: count
+ * the results and fill in the header.  Set incomplete if generation
+ * was stopped before all positions were decided.  If tb only holds the
+ * stored positions, won and lost are the bitmaps from struct
+ * gentb_table describing the others.  Otherwise, they are NULL.
+ */
+extern void
+finish_tablebase(struct tablebase *tb, const atomic_ulong *won, const atomic_ulong *lost,
+    unsigned rounds, int incomplete)
+{
+
+	/* this is fast enough to do synchronously */
+	count_wdl(tb, won, lost);
+
+	tb->header.version = TBHDR_VERSION;
+	tb->header.encoding = TBHDR_DTM;
+	tb->header.crc = 0;
+	tb->header.size = POSITION_COUNT;
+	tb->header.created = time(NULL);
+	tb->header.rounds = rounds;
+	tb->header.flags = incomplete ? TBHDR_INCOMPLETE : 0;
 }
 
 /*
  * Count how many positions are wins, draws, and losses and print the
  * figures to stderr.  Also erase all invalid and mate positions from
  * the table base and overwrite them with the most common value (2) as
- * we never read them again.
+ * we never read them again.  won and lost are as for
+ * finish_tablebase().
  */
 static void
-count_wdl(struct tablebase *tb)
+count_wdl(struct tablebase *tb, const atomic_ulong *won, const atomic_ulong *lost)
 {
 	poscode pc;
-	size_t offset;
-	unsigned size, win = 0, draw = 0, loss = 0;
+	size_t offset, base, end;
+	unsigned win = 0, draw = 0, loss = 0;
 	tb_entry e;
 
+	pc.lionpos = pc.map = 0;
 	for (pc.ownership = 0; pc.ownership < OWNERSHIP_TOTAL_COUNT; pc.ownership++)
 		for (pc.cohort = 0; pc.cohort < COHORT_COUNT; pc.cohort++) {
-			size = cohort_size[pc.cohort].size;
-			if (!has_valid_ownership(pc)) {
-				pc.lionpos = pc.map = 0;
-				memset((char*)tb->positions + position_offset(pc), 2, size * LIONPOS_COUNT);
-			} else for (pc.lionpos = 0; pc.lionpos < LIONPOS_COUNT; pc.lionpos++)
-				for (pc.map = 0; pc.map < size; pc.map++) {
-					offset = position_offset(pc);					
-					e = tb->positions[offset];
-					if (is_win(e))
+			/* the positions of each ownership and cohort are contiguous */
+			base = position_offset(pc);
+			end = base + cohort_size[pc.cohort].size * LIONPOS_COUNT;
+			if (base >= POSITION_COUNT && won != NULL) {
+				/* positions not stored are only counted */
+				if (!has_valid_ownership(pc))
+					continue;
+
+				for (offset = base - POSITION_COUNT; offset < end - POSITION_COUNT; offset++) {
+					if (test_bit(won, offset))
 						win++;
-					else if (is_loss(e))
+					else if (test_bit(lost, offset))
 						loss++;
-					else /* is_draw(e) */
+					else
 						draw++;
-					if (e == 1)
-						tb->positions[offset] = 2;
 				}
+			} else if (!has_valid_ownership(pc)) {
+				memset((char*)tb->positions + base, 2, end - base);
+			} else for (offset = base; offset < end; offset++) {
+				e = tb->positions[offset];
+				if (is_win(e))
+					win++;
+				else if (is_loss(e))
+					loss++;
+				else /* is_draw(e) */
+					draw++;
+				if (e == 1)
+					tb->positions[offset] = 2;
+			}
 		}
 
 	fprintf(stderr, "Total:    %9u  %9u  %9u\n", win, loss, draw);
 }
 
 /*
- * Write tb to file f.  It is assumed that f has been opened in binary
+ * Write tb to file f, preceded by a header as described in
+ * dobutsutable.h.  It is assumed that f has been opened in binary
  * mode for writing and truncated.  This function returns 0 on success,
  * -1 on error with errno indicating the reason for failure.
  */
 extern int
 write_tablebase(FILE *f, const struct tablebase *tb)
 {
+	struct tbheader hdr = tb->header;
+
+	return (write_tbfile(f, &hdr, (const void*)tb->positions,
+	    tb->wdl ? WDL_SIZE : POSITION_COUNT));
+}
+
+/*
+ * Write tb to file f, only recording whether each position is won,
+ * drawn, or lost.  Two bits are used per position, making the file a
+ * quarter of the size of a full tablebase.  Otherwise, this function
+ * behaves like write_tablebase().
+ */
+extern int
+write_wdl_tablebase(FILE *f, const struct tablebase *tb)
+{
+	struct tbheader hdr = tb->header;
+	size_t i;
+	tb_entry e;
+	unsigned char *buf, code;
+	int result;
+
+	if (tb->wdl)
+		return (write_tablebase(f, tb));
+
+	buf = calloc(WDL_SIZE, 1);
+	if (buf == NULL)
+		return (-1);
+
+	for (i = 0; i < POSITION_COUNT; i++) {
+		e = tb->positions[i];
+		code = is_win(e) ? WDL_WIN : is_loss(e) ? WDL_LOSS : WDL_DRAW;
+		buf[i / 4] |= code << 2 * (i % 4);
+	}
+
+	hdr.encoding = TBHDR_WDL;
+	result = write_tbfile(f, &hdr, buf, WDL_SIZE);
+	free(buf);
+
+	return (result);
+}
+
+/*
+ * Write a tablebase file made of the size bytes at data preceded by
+ * hdr to f.  The size and checksum in hdr are filled in.  Return 0 on
+ * success, -1 on error.
+ */
+static int
+write_tbfile(FILE *f, struct tbheader *hdr, const void *data, size_t size)
+{
+	unsigned char buf[TBHDR_SIZE];
+
+	hdr->size = size;
+	hdr->crc = tablebase_crc(data, size);
+	encode_tbheader(buf, hdr);
 
-	fwrite((void*)tb->positions, sizeof tb->positions, 1, f);
+	fwrite(buf, sizeof buf, 1, f);
+	fwrite(data, size, 1, f);
 	fflush(f);
 
 	return (ferror(f) ? -1 : 0);
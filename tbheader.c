@@ -0,0 +1,172 @@
+/*-
+ * Copyright (c) 2016--2017 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <string.h>
+
+#include "xz/xz.h"
+#include "dobutsutable.h"
+
+/*
+ * Encode and decode the header at the beginning of each tablebase
+ * file.  See dobutsutable.h for the format.
+ */
+
+static const unsigned char tbheader_magic[8] = { 'D', 'B', 'T', 'B', 'F', 'I', 'L', 'E' };
+
+static void			put_le32(unsigned char *, unsigned);
+static void			put_le64(unsigned char *, unsigned long long);
+static unsigned			get_le32(const unsigned char *);
+static unsigned long long	get_le64(const unsigned char *);
+
+/*
+ * Encode hdr into buf.  The magic number is added and the reserved
+ * fields are zeroed.
+ */
+extern void
+encode_tbheader(unsigned char buf[TBHDR_SIZE], const struct tbheader *hdr)
+{
+
+	memset(buf, 0, TBHDR_SIZE);
+	memcpy(buf, tbheader_magic, sizeof tbheader_magic);
+	put_le32(buf + 8, hdr->version);
+	put_le32(buf + 16, hdr->encoding);
+	put_le32(buf + 20, hdr->crc);
+	put_le64(buf + 24, hdr->size);
+	put_le64(buf + 32, hdr->created);
+	put_le32(buf + 40, hdr->rounds);
+	put_le32(buf + 44, hdr->flags);
+}
+
+/*
+ * Decode the header in buf into hdr and check that it describes a
+ * tablebase this program can use: the format version must match, the
+ * word at offset 12 must be zero, the size must be right for the
+ * encoding and the tablebase must be complete.
+ * Return 0 on success, -1 with errno set to EINVAL otherwise.
+ */
+extern int
+decode_tbheader(struct tbheader *hdr, const unsigned char buf[TBHDR_SIZE])
+{
+
+	if (memcmp(buf, tbheader_magic, sizeof tbheader_magic) != 0)
+		goto invalid;
+
+	hdr->version = get_le32(buf + 8);
+	hdr->encoding = get_le32(buf + 16);
+	hdr->crc = get_le32(buf + 20);
+	hdr->size = get_le64(buf + 24);
+	hdr->created = get_le64(buf + 32);
+	hdr->rounds = get_le32(buf + 40);
+	hdr->flags = get_le32(buf + 44);
+
+	if (hdr->version != TBHDR_VERSION || get_le32(buf + 12) != 0)
+		goto invalid;
+
+	/* positions left undecided would read as draws */
+	if (hdr->flags & TBHDR_INCOMPLETE)
+		goto invalid;
+
+	switch (hdr->encoding) {
+	case TBHDR_DTM:
+		if (hdr->size != POSITION_COUNT)
+			goto invalid;
+
+		break;
+
+	case TBHDR_WDL:
+		if (hdr->size != WDL_SIZE)
+			goto invalid;
+
+		break;
+
+	default:
+		goto invalid;
+	}
+
+	return (0);
+
+invalid:
+	errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * Compute the CRC32 of the len bytes at buf as recorded in the header.
+ */
+extern unsigned
+tablebase_crc(const void *buf, size_t len)
+{
+
+	/* as this function is idempotent, call it just to be sure */
+	xz_crc32_init();
+
+	return (xz_crc32(buf, len, 0));
+}
+
+/*
+ * Encode val into buf as a little-endian 32 bit integer.
+ */
+static void
+put_le32(unsigned char *buf, unsigned val)
+{
+
+	buf[0] = val & 0xff;
+	buf[1] = val >> 8 & 0xff;
+	buf[2] = val >> 16 & 0xff;
+	buf[3] = val >> 24 & 0xff;
+}
+
+/*
+ * Encode val into buf as a little-endian 64 bit integer.
+ */
+static void
+put_le64(unsigned char *buf, unsigned long long val)
+{
+
+	put_le32(buf, val & 0xffffffff);
+	put_le32(buf + 4, val >> 32);
+}
+
+/*
+ * Decode a little-endian 32 bit integer.
+ */
+static unsigned
+get_le32(const unsigned char *buf)
+{
+
+	return ((unsigned)buf[0] | (unsigned)buf[1] << 8
+	    | (unsigned)buf[2] << 16 | (unsigned)buf[3] << 24);
+}
+
+/*
+ * Decode a little-endian 64 bit integer.
+ */
+static unsigned long long
+get_le64(const unsigned char *buf)
+{
+
+	return (get_le32(buf) | (unsigned long long)get_le32(buf + 4) << 32);
+}
@@ -0,0 +1,854 @@
+/*-
+ * Copyright (c) 2016--2017 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dobutsutable.h"
+
+/*
+ * This file implements out-of-core generation of the tablebase for
+ * machines that cannot hold it in memory.  The tablebase under
+ * construction and the counters of the counter algorithm (see
+ * counter_round_pos() in tbgenerate.c) are kept in files in a scratch
+ * directory.  The encoding space is split into partitions made of
+ * whole chunks of positions of one ownership and cohort each, and
+ * only one partition is held in memory at a time.
+ *
+ * Work a partition causes in other partitions is written to their
+ * update queues, one file per partition for changes to counters and
+ * one for changes to the tablebase, and carried out once the partition
+ * is loaded.  Round n consists of three passes over the partitions:
+ *
+ *  1. For each position won in n moves, queue a decrement for the
+ *     counters of its predecessors.  In the first round, evaluate
+ *     every position instead and queue the initial counter values
+ *     for positions whose counter lives in another partition.
+ *  2. Apply the counter updates.  Positions whose counter reaches
+ *     zero are lost in n moves, queue marks for their predecessors as
+ *     won in n + 1 moves and for their mirror images as lost.
+ *  3. Apply the tablebase updates.
+ *
+ * Marks for positions in the partition being worked on are applied
+ * right away.  The result is the same as that of generate_tablebase()
+ * with the other algorithms.
+ */
+
+enum {
+	/* most ownership and cohort chunks there can be */
+	MAX_CHUNKS = OWNERSHIP_TOTAL_COUNT * COHORT_COUNT,
+
+	/* number of updates read from a queue at once */
+	UPDATE_BLOCK = 65536,
+};
+
+/*
+ * A chunk of size * LIONPOS_COUNT positions of the given ownership and
+ * cohort, beginning at offset in the tablebase.  size is the size of
+ * the cohort.
+ */
+struct chunk {
+	size_t offset, size;
+	unsigned char ownership, cohort;
+};
+
+/*
+ * A partition is made of the chunks first to last (exclusive) and
+ * covers the offsets start to end (exclusive), including the gaps
+ * between the chunks.  counts and marks are its update queues.  due is
+ * set if the partition may hold positions won in the next round.
+ */
+struct partition {
+	size_t start, end;
+	unsigned first, last;
+	FILE *counts, *marks;
+	int due;
+};
+
+/*
+ * An entry in an update queue: for counts, add value to the counter
+ * at offset, for marks, set the entry at offset to value unless it has
+ * already been decided.
+ */
+struct update {
+	uint32_t offset;
+	int32_t value;
+};
+
+/*
+ * The state of an out-of-core generation.  tbfd and counterfd refer
+ * to the files holding the tablebase and the counters.  positions and
+ * counters hold the part of either belonging to the partition
+ * currently loaded.  updates is a buffer for UPDATE_BLOCK updates
+ * read from a queue.  round, win, and loss are the current round and
+ * the number of positions won and lost in it.
+ */
+struct partgen {
+	struct chunk chunks[MAX_CHUNKS];
+	struct partition *parts;
+	size_t nchunk, npart;
+	signed char *positions;
+	unsigned char *counters;
+	struct update *updates;
+	int tbfd, counterfd;
+	unsigned round, win, loss;
+};
+
+static int	 compare_chunks(const void *, const void *);
+static void	 make_chunks(struct partgen *);
+static int	 make_partitions(struct partgen *, size_t);
+static int	 scratch_file(const char *);
+static FILE	*scratch_queue(const char *);
+static int	 read_fully(int, void *, size_t, off_t);
+static int	 write_fully(int, const void *, size_t, off_t);
+static int	 load_partition(struct partgen *, const struct partition *, int);
+static int	 store_partition(struct partgen *, const struct partition *, int);
+static struct partition *find_partition(struct partgen *, size_t);
+static poscode	 offset_poscode(const struct partgen *, const struct partition *, size_t);
+static void	 queue_update(FILE *, size_t, int);
+static void	 add_counter(struct partgen *, struct partition *, size_t, int);
+static void	 set_entry(struct partgen *, struct partition *, size_t, tb_entry);
+static void	 mark_both(struct partgen *, struct partition *, const struct position *, tb_entry);
+static int	 initial_pass(struct partgen *, struct partition *);
+static int	 frontier_pass(struct partgen *, struct partition *);
+static int	 counter_pass(struct partgen *, struct partition *);
+static int	 mark_pass(struct partgen *, struct partition *);
+static void	 lose_position(struct partgen *, struct partition *, size_t);
+static int	 run_pass(struct partgen *, int (*)(struct partgen *, struct partition *));
+static void	 free_partgen(struct partgen *);
+
+/*
+ * Generate the tablebase out of core as described above, keeping
+ * scratch files in opts->workdir and loading at most
+ * opts->partition_size positions at once unless a single chunk is
+ * larger.  The memory needed is about twice that.  Of the other
+ * options, only max_rounds is used; generate_tablebase() rejects the
+ * ones that conflict with this mode.  The tablebase returned
+ * is mapped from a scratch file, which is removed once the tablebase
+ * is freed.  On failure, return NULL and set errno.
+ */
+extern struct tablebase *
+generate_partitioned(const struct gentb_options *opts)
+{
+	struct partgen *pg;
+	struct tablebase *tb;
+	size_t i;
+	void *map;
+	int error, done = 0;
+
+	pg = calloc(1, sizeof *pg);
+	if (pg == NULL)
+		return (NULL);
+
+	pg->tbfd = pg->counterfd = -1;
+	make_chunks(pg);
+	if (make_partitions(pg, opts->partition_size) != 0)
+		goto fail;
+
+	pg->tbfd = scratch_file(opts->workdir);
+	pg->counterfd = scratch_file(opts->workdir);
+	if (pg->tbfd == -1 || pg->counterfd == -1)
+		goto fail;
+
+	if (ftruncate(pg->tbfd, POSITION_TOTAL_COUNT) != 0
+	    || ftruncate(pg->counterfd, POSITION_TOTAL_COUNT) != 0)
+		goto fail;
+
+	for (i = 0; i < pg->npart; i++) {
+		pg->parts[i].counts = scratch_queue(opts->workdir);
+		pg->parts[i].marks = scratch_queue(opts->workdir);
+		if (pg->parts[i].counts == NULL || pg->parts[i].marks == NULL)
+			goto fail;
+	}
+
+	pg->updates = malloc(UPDATE_BLOCK * sizeof *pg->updates);
+	if (pg->updates == NULL)
+		goto fail;
+
+	for (pg->round = 1; !done; pg->round++) {
+		fprintf(stderr, "Round %2u: ", pg->round);
+		pg->win = pg->loss = 0;
+
+		if (run_pass(pg, pg->round == 1 ? initial_pass : frontier_pass) != 0
+		    || run_pass(pg, counter_pass) != 0
+		    || run_pass(pg, mark_pass) != 0)
+			goto fail;
+
+		fprintf(stderr, "%9u  %9u\n", pg->win, pg->loss);
+
+		done = pg->loss == 0
+		    || (opts->max_rounds != 0 && pg->round >= opts->max_rounds);
+	}
+
+	pg->round--;
+
+	tb = malloc(sizeof *tb);
+	if (tb == NULL)
+		goto fail;
+
+	/* the scratch file is already unlinked, the mapping keeps it alive */
+	map = mmap(NULL, POSITION_TOTAL_COUNT, PROT_READ | PROT_WRITE, MAP_SHARED, pg->tbfd, 0);
+	if (map == MAP_FAILED) {
+		error = errno;
+		free(tb);
+		errno = error;
+		goto fail;
+	}
+
+	tb->positions = map;
+	tb->map = map;
+	tb->mapsize = POSITION_TOTAL_COUNT;
+	tb->pages = TB_PAGES_DEFAULT;
+	tb->cache = NULL;
+	tb->wdl = 0;
+	finish_tablebase(tb, NULL, NULL, pg->round, pg->loss != 0);
+	free_partgen(pg);
+
+	return (tb);
+
+fail:
+	error = errno;
+	free_partgen(pg);
+	errno = error;
+
+	return (NULL);
+}
+
+/*
+ * Release all resources held by pg, closing and thus removing the
+ * scratch files.
+ */
+static void
+free_partgen(struct partgen *pg)
+{
+	size_t i;
+
+	for (i = 0; i < pg->npart; i++) {
+		if (pg->parts[i].counts != NULL)
+			fclose(pg->parts[i].counts);
+
+		if (pg->parts[i].marks != NULL)
+			fclose(pg->parts[i].marks);
+	}
+
+	if (pg->tbfd != -1)
+		close(pg->tbfd);
+
+	if (pg->counterfd != -1)
+		close(pg->counterfd);
+
+	free(pg->parts);
+	free(pg->positions);
+	free(pg->counters);
+	free(pg->updates);
+	free(pg);
+}
+
+/*
+ * Fill in pg->chunks with the chunks of positions with valid
+ * ownership in the order they appear in the tablebase.
+ */
+static void
+make_chunks(struct partgen *pg)
+{
+	poscode pc;
+	struct chunk *c;
+
+	pc.lionpos = pc.map = 0;
+	for (pc.ownership = 0; pc.ownership < OWNERSHIP_TOTAL_COUNT; pc.ownership++)
+		for (pc.cohort = 0; pc.cohort < COHORT_COUNT; pc.cohort++) {
+			if (!has_valid_ownership(pc))
+				continue;
+
+			c = pg->chunks + pg->nchunk++;
+			c->offset = position_offset(pc);
+			c->size = cohort_size[pc.cohort].size;
+			c->ownership = pc.ownership;
+			c->cohort = pc.cohort;
+		}
+
+	qsort(pg->chunks, pg->nchunk, sizeof *pg->chunks, compare_chunks);
+}
+
+/*
+ * Order two chunks by their offsets.
+ */
+static int
+compare_chunks(const void *a, const void *b)
+{
+	const struct chunk *ca = a, *cb = b;
+
+	return ((ca->offset > cb->offset) - (ca->offset < cb->offset));
+}
+
+/*
+ * Group consecutive chunks into partitions of at most size positions,
+ * but at least one chunk each.  Allocate the partition buffers.
+ * Return 0 on success, -1 on failure.
+ */
+static int
+make_partitions(struct partgen *pg, size_t size)
+{
+	struct partition *part;
+	size_t i, end, maxsize = 0;
+
+	pg->parts = calloc(pg->nchunk, sizeof *pg->parts);
+	if (pg->parts == NULL)
+		return (-1);
+
+	for (i = 0; i < pg->nchunk; i++) {
+		end = pg->chunks[i].offset + pg->chunks[i].size * LIONPOS_COUNT;
+		part = pg->parts + pg->npart - 1;
+		if (pg->npart == 0 || end - part->start > size) {
+			part = pg->parts + pg->npart++;
+			part->start = pg->chunks[i].offset;
+			part->first = i;
+		}
+
+		part->end = end;
+		part->last = i + 1;
+		if (part->end - part->start > maxsize)
+			maxsize = part->end - part->start;
+	}
+
+	pg->positions = malloc(maxsize);
+	pg->counters = malloc(maxsize);
+	if (pg->positions == NULL || pg->counters == NULL)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Create a scratch file in directory dir and remove it right away so
+ * it goes away once closed.  Return a file descriptor for it or -1 on
+ * failure.
+ */
+static int
+scratch_file(const char *dir)
+{
+	size_t len = strlen(dir);
+	int fd;
+	char *path;
+
+	path = malloc(len + sizeof "/gentb.XXXXXX");
+	if (path == NULL)
+		return (-1);
+
+	memcpy(path, dir, len);
+	memcpy(path + len, "/gentb.XXXXXX", sizeof "/gentb.XXXXXX");
+
+	fd = mkstemp(path);
+	if (fd != -1)
+		unlink(path);
+
+	free(path);
+	return (fd);
+}
+
+/*
+ * Create an empty update queue in dir, see scratch_file().  Return
+ * NULL on failure.
+ */
+static FILE *
+scratch_queue(const char *dir)
+{
+	FILE *f;
+	int fd;
+
+	fd = scratch_file(dir);
+	if (fd == -1)
+		return (NULL);
+
+	f = fdopen(fd, "w+b");
+	if (f == NULL)
+		close(fd);
+
+	return (f);
+}
+
+/*
+ * Read exactly len bytes at offset from fd into buf.  Return 0 on
+ * success, -1 on failure.  A premature end of file is reported as EIO.
+ */
+static int
+read_fully(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		count = pread(fd, buf, len, offset);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return (-1);
+		}
+
+		if (count == 0) {
+			errno = EIO;
+			return (-1);
+		}
+
+		buf = (char*)buf + count;
+		len -= count;
+		offset += count;
+	}
+
+	return (0);
+}
+
+/*
+ * Write len bytes from buf to fd at offset.  Return 0 on success, -1
+ * on failure.
+ */
+static int
+write_fully(int fd, const void *buf, size_t len, off_t offset)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		count = pwrite(fd, buf, len, offset);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return (-1);
+		}
+
+		buf = (const char*)buf + count;
+		len -= count;
+		offset += count;
+	}
+
+	return (0);
+}
+
+/*
+ * Read the entries of part into pg->positions and, if counters is
+ * set, its counters into pg->counters.  Return 0 on success, -1 on
+ * failure.
+ */
+static int
+load_partition(struct partgen *pg, const struct partition *part, int counters)
+{
+	size_t len = part->end - part->start;
+
+	if (read_fully(pg->tbfd, pg->positions, len, part->start) != 0)
+		return (-1);
+
+	if (counters && read_fully(pg->counterfd, pg->counters, len, part->start) != 0)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Write back what load_partition() read.  Return 0 on success, -1 on
+ * failure.
+ */
+static int
+store_partition(struct partgen *pg, const struct partition *part, int counters)
+{
+	size_t len = part->end - part->start;
+
+	if (write_fully(pg->tbfd, pg->positions, len, part->start) != 0)
+		return (-1);
+
+	if (counters && write_fully(pg->counterfd, pg->counters, len, part->start) != 0)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Return the partition offset belongs to.
+ */
+static struct partition *
+find_partition(struct partgen *pg, size_t offset)
+{
+	size_t lo = 0, hi = pg->npart, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (pg->parts[mid].start <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	assert(offset >= pg->parts[lo].start && offset < pg->parts[lo].end);
+
+	return (pg->parts + lo);
+}
+
+/*
+ * Return the poscode of the position at offset, which must be in part.
+ */
+static poscode
+offset_poscode(const struct partgen *pg, const struct partition *part, size_t offset)
+{
+	const struct chunk *c;
+	poscode pc;
+	size_t lo = part->first, hi = part->last, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (pg->chunks[mid].offset <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	c = pg->chunks + lo;
+	pc.ownership = c->ownership;
+	pc.cohort = c->cohort;
+	pc.lionpos = (offset - c->offset) / c->size;
+	pc.map = (offset - c->offset) % c->size;
+
+	return (pc);
+}
+
+/*
+ * Append an update to queue f.  Errors are detected with ferror()
+ * once the queue is applied.
+ */
+static void
+queue_update(FILE *f, size_t offset, int value)
+{
+	struct update u;
+
+	u.offset = offset;
+	u.value = value;
+	fwrite(&u, sizeof u, 1, f);
+}
+
+/*
+ * Add value to the counter at offset.  part is the partition loaded.
+ */
+static void
+add_counter(struct partgen *pg, struct partition *part, size_t offset, int value)
+{
+
+	if (offset >= part->start && offset < part->end)
+		pg->counters[offset - part->start] += value;
+	else
+		queue_update(find_partition(pg, offset)->counts, offset, value);
+}
+
+/*
+ * Set the entry at offset to e unless it has already been decided.
+ * part is the partition loaded.
+ */
+static void
+set_entry(struct partgen *pg, struct partition *part, size_t offset, tb_entry e)
+{
+	signed char *entry;
+
+	if (offset < part->start || offset >= part->end) {
+		queue_update(find_partition(pg, offset)->marks, offset, e);
+		return;
+	}
+
+	entry = pg->positions + (offset - part->start);
+	if (*entry != 0)
+		return;
+
+	*entry = e;
+	if (is_loss(e))
+		pg->loss++;
+	else
+		part->due = 1;
+}
+
+/*
+ * Set the entries of p and its mirror image to e unless they have
+ * been decided already, see mark_position() in tbgenerate.c.
+ */
+static void
+mark_both(struct partgen *pg, struct partition *part, const struct position *p, tb_entry e)
+{
+	struct position pmirror = *p;
+	poscode pc;
+
+	encode_position(&pc, &pmirror);
+	set_entry(pg, part, position_offset(pc), e);
+
+	if (position_mirror(&pmirror)) {
+		encode_position(&pc, &pmirror);
+		set_entry(pg, part, position_offset(pc), e);
+	}
+}
+
+/*
+ * Load each partition, call pass on it, and store it again.  Return 0
+ * on success, -1 on failure.
+ */
+static int
+run_pass(struct partgen *pg, int (*pass)(struct partgen *, struct partition *))
+{
+	size_t i;
+
+	for (i = 0; i < pg->npart; i++)
+		if (pass(pg, pg->parts + i) != 0)
+			return (-1);
+
+	return (0);
+}
+
+/*
+ * First pass of the first round: evaluate every position in part as
+ * initial_round_pos() in tbgenerate.c does and compute its counter.
+ * The two poscodes of positions with both lions on the B file add to
+ * the counter at the smaller of their offsets, which may be in
+ * another partition.
+ */
+static int
+initial_pass(struct partgen *pg, struct partition *part)
+{
+	struct poscode_decoder pd;
+	struct position pp;
+	struct move moves[MAX_MOVES];
+	struct unmove unmoves[MAX_UNMOVES];
+	const struct chunk *c;
+	poscode pc;
+	size_t i, j, offset, moffset, nmove, nunmove;
+	unsigned k;
+
+	if (load_partition(pg, part, 1) != 0)
+		return (-1);
+
+	for (k = part->first; k < part->last; k++) {
+		c = pg->chunks + k;
+		pc.ownership = c->ownership;
+		pc.cohort = c->cohort;
+		pc.lionpos = pc.map = 0;
+		start_decoder(&pd, pc);
+
+		for (i = 0; i < c->size * LIONPOS_COUNT; i++, next_poscode(&pd)) {
+			offset = c->offset + i;
+			if (gote_in_check(&pd.p)) {
+				pg->positions[offset - part->start] = 1;
+				pg->win++;
+				continue;
+			}
+
+			nmove = generate_legal_moves(moves, &pd.p);
+			if (nmove != 0) {
+				pp = pd.p;
+				if (position_mirror(&pp)) {
+					encode_position(&pc, &pp);
+					moffset = position_offset(pc);
+					add_counter(pg, part, moffset < offset ? moffset : offset, nmove);
+				} else
+					pg->counters[offset - part->start] = 2 * nmove;
+
+				continue;
+			}
+
+			pg->positions[offset - part->start] = -1;
+			pg->loss++;
+
+			nunmove = generate_unmoves(unmoves, &pd.p);
+			for (j = 0; j < nunmove; j++) {
+				pp = pd.p;
+				undo_move(&pp, unmoves + j);
+				if (!sente_in_check(&pp))
+					mark_both(pg, part, &pp, 2);
+			}
+		}
+	}
+
+	return (store_partition(pg, part, 1));
+}
+
+/*
+ * First pass of the other rounds: for each position in part won in
+ * pg->round moves, queue a decrement for the counter of each
+ * predecessor as counter_round_pos() in tbgenerate.c does.  Only
+ * partitions that had positions marked as won last round are
+ * looked at.
+ */
+static int
+frontier_pass(struct partgen *pg, struct partition *part)
+{
+	struct position p, pp, ppmirror;
+	struct move_encoder me;
+	struct unmove unmoves[MAX_UNMOVES];
+	poscode pc;
+	size_t offset, ppoffset, moffset, i, nunmove;
+	int weight;
+
+	if (!part->due)
+		return (0);
+
+	part->due = 0;
+	if (load_partition(pg, part, 0) != 0)
+		return (-1);
+
+	for (offset = part->start; offset < part->end; offset++) {
+		if (pg->positions[offset - part->start] != (tb_entry)pg->round)
+			continue;
+
+		pg->win++;
+		decode_poscode(&p, offset_poscode(pg, part, offset));
+		pp = p;
+		weight = position_mirror(&pp) ? 1 : 2;
+
+		prepare_encoder(&me, &p);
+		nunmove = generate_unmoves(unmoves, &p);
+		for (i = 0; i < nunmove; i++) {
+			encode_unmove(&pc, &me, &p, unmoves + i);
+			if (pc.lionpos >= LIONPOS_COUNT)
+				continue;
+
+			ppoffset = position_offset(pc);
+			if (ppoffset >= part->start && ppoffset < part->end
+			    && pg->positions[ppoffset - part->start] != 0)
+				continue;
+
+			pp = p;
+			undo_move(&pp, unmoves + i);
+			ppmirror = pp;
+			if (position_mirror(&ppmirror)) {
+				encode_position(&pc, &ppmirror);
+				moffset = position_offset(pc);
+				if (moffset < ppoffset)
+					ppoffset = moffset;
+			}
+
+			queue_update(find_partition(pg, ppoffset)->counts, ppoffset, -weight);
+		}
+	}
+
+	/* positions are only read */
+	return (0);
+}
+
+/*
+ * Second pass: apply the counter updates queued for part.  Positions
+ * whose counter drops to zero are lost.
+ */
+static int
+counter_pass(struct partgen *pg, struct partition *part)
+{
+	struct update *u;
+	size_t i, n, offset;
+	unsigned char *counter;
+	int loaded = 0;
+
+	if (fflush(part->counts) != 0 || ferror(part->counts))
+		return (-1);
+
+	rewind(part->counts);
+	while (n = fread(pg->updates, sizeof *pg->updates, UPDATE_BLOCK, part->counts), n > 0) {
+		if (!loaded && load_partition(pg, part, 1) != 0)
+			return (-1);
+
+		loaded = 1;
+		for (i = 0; i < n; i++) {
+			u = pg->updates + i;
+			offset = u->offset - part->start;
+			if (pg->positions[offset] != 0)
+				continue;
+
+			counter = pg->counters + offset;
+			assert(u->value > 0 || *counter >= -u->value);
+			*counter += u->value;
+			if (*counter == 0)
+				lose_position(pg, part, u->offset);
+		}
+	}
+
+	if (ferror(part->counts))
+		return (-1);
+
+	rewind(part->counts);
+	if (ftruncate(fileno(part->counts), 0) != 0)
+		return (-1);
+
+	return (loaded ? store_partition(pg, part, 1) : 0);
+}
+
+/*
+ * Mark the position at offset in part and its mirror image as lost in
+ * pg->round moves and its predecessors as won in pg->round + 1 moves.
+ */
+static void
+lose_position(struct partgen *pg, struct partition *part, size_t offset)
+{
+	struct position p, pp;
+	struct unmove unmoves[MAX_UNMOVES];
+	size_t i, nunmove;
+
+	decode_poscode(&p, offset_poscode(pg, part, offset));
+	mark_both(pg, part, &p, -(tb_entry)pg->round);
+
+	nunmove = generate_unmoves(unmoves, &p);
+	for (i = 0; i < nunmove; i++) {
+		pp = p;
+		undo_move(&pp, unmoves + i);
+		if (!sente_in_check(&pp))
+			mark_both(pg, part, &pp, pg->round + 1);
+	}
+}
+
+/*
+ * Third pass: apply the marks queued for part.
+ */
+static int
+mark_pass(struct partgen *pg, struct partition *part)
+{
+	size_t i, n;
+	int loaded = 0;
+
+	if (fflush(part->marks) != 0 || ferror(part->marks))
+		return (-1);
+
+	rewind(part->marks);
+	while (n = fread(pg->updates, sizeof *pg->updates, UPDATE_BLOCK, part->marks), n > 0) {
+		if (!loaded && load_partition(pg, part, 0) != 0)
+			return (-1);
+
+		loaded = 1;
+		for (i = 0; i < n; i++)
+			set_entry(pg, part, pg->updates[i].offset, pg->updates[i].value);
+	}
+
+	if (ferror(part->marks))
+		return (-1);
+
+	rewind(part->marks);
+	if (ftruncate(fileno(part->marks), 0) != 0)
+		return (-1);
+
+	return (loaded ? store_partition(pg, part, 0) : 0);
+}
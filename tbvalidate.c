@@ -27,7 +27,7 @@
 
 #include "dobutsutable.h"
 
-static int validate_position(const struct tablebase *, poscode);
+static int validate_position(const struct tablebase *, const struct poscode_decoder *);
 
 /*
  * Check if the tablebase tb is internally consistent.  If any
@@ -37,37 +37,55 @@ static int validate_position(const struct tablebase *, poscode);
 extern int
 validate_tablebase(const struct tablebase *tb)
 {
+	struct poscode_decoder pd;
 	poscode pc;
-	unsigned size;
+	unsigned i, count;
 	int result = 1;
 
+	pc.lionpos = pc.map = 0;
 	for (pc.ownership = 0; pc.ownership < OWNERSHIP_TOTAL_COUNT; pc.ownership++)
 		for (pc.cohort = 0; pc.cohort < COHORT_COUNT; pc.cohort++) {
 			if (!has_valid_ownership(pc))
 				continue;
 
-			size = cohort_size[pc.cohort].size;
-			for (pc.lionpos = 0; pc.lionpos < LIONPOS_COUNT; pc.lionpos++)
-				for (pc.map = 0; pc.map < size; pc.map++)
-					result &= validate_position(tb, pc);
+			count = cohort_size[pc.cohort].size * LIONPOS_COUNT;
+			start_decoder(&pd, pc);
+			for (i = 0; i < count; i++) {
+				result &= validate_position(tb, &pd);
+				next_poscode(&pd);
+			}
 	}
 
 	return (result);
 }
 
 /*
- * Validate a single position by checking every position reachable from it and
- * making sure, that it's one better than the best reachable result.
+ * Validate the position pd has decoded last by checking every position
+ * reachable from it and making sure, that it's one better than the best
+ * reachable result.  Also check that the position encodes back to its
+ * poscode.
  */
 static int
-validate_position(const struct tablebase *tb, poscode pc)
+validate_position(const struct tablebase *tb, const struct poscode_decoder *pd)
 {
-	struct position p, bestp;
+	struct position p = pd->p, bestp;
 	struct move moves[MAX_MOVES], bestmove;
 	size_t i, nmove;
+	poscode pc = pd->pc, epc;
 	tb_entry bestvalue = 1, actual;
 
-	decode_poscode(&p, pc);
+	encode_position(&epc, &p);
+	if (epc.ownership != pc.ownership || epc.cohort != pc.cohort
+	    || epc.lionpos != pc.lionpos || epc.map != pc.map) {
+		char posstr[MAX_POSSTR];
+
+		position_string(posstr, &p);
+		fprintf(stderr, "%-24s (%2u %2u %2u %5u) encodes to (%2u %2u %2u %5u)\n", posstr,
+		    pc.ownership, pc.cohort, pc.lionpos, pc.map,
+		    epc.ownership, epc.cohort, epc.lionpos, epc.map);
+		return (0);
+	}
+
 	actual = lookup_position(tb, &p);
 
 	/*
@@ -81,7 +99,7 @@ validate_position(const struct tablebase *tb, poscode pc)
 	if (nmove == 0) {
 		char posstr[MAX_POSSTR];
 
-		if (actual == -1)
+		if (actual == -1 || actual == -WDL_DISTANCE)
 			return (1);
 
 		position_string(posstr, &p);
@@ -109,7 +127,9 @@ validate_position(const struct tablebase *tb, poscode pc)
 		}
 	}
 
-	if (next_dtm(actual) != bestvalue) {
+	/* without distance information, only check win/draw/loss */
+	if (has_dtm(actual) ? next_dtm(actual) != bestvalue
+	    : is_win(actual) ? !is_loss(bestvalue) : !is_win(bestvalue)) {
 		char posstr[MAX_POSSTR], movstr[MAX_MOVSTR];
 
 		position_string(posstr, &p);
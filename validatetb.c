@@ -44,7 +44,7 @@ main(int argc, char *argv[])
 		return (EXIT_FAILURE);
 	}
 
-	tb = read_tablebase(tbfile);
+	tb = read_tablebase(tbfile, TB_WILLNEED | TB_VERIFY);
 	if (tb == NULL) {
 		perror("read_tablebase");
 		return (EXIT_FAILURE);
@@ -0,0 +1,334 @@
+/*-
+ * Copyright (c) 2016--2017 Robert Clausecker. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xz/xz.h"
+#include "dobutsutable.h"
+
+/*
+ * The xz file format allows a stream to be split into multiple
+ * independently compressed blocks and records the compressed and
+ * uncompressed size of each block in an index at the end of the
+ * stream.  If the tablebase has been compressed with a block size
+ * (see XZFLAGS in the Makefile), this index can be used to decompress
+ * only those parts of the tablebase that are actually needed.  The
+ * code in this file parses the index and decompresses single blocks.
+ *
+ * Only files containing exactly one xz stream without stream padding
+ * and using either no integrity check or CRC32 are supported.  This
+ * is what xz -C crc32 produces.
+ */
+
+enum {
+	XZ_HEADER_SIZE = 12,
+	XZ_FOOTER_SIZE = 12,
+
+	/* longest valid variable-length integer */
+	XZ_VLI_MAX_BYTES = 9,
+};
+
+static const unsigned char header_magic[6] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+static const unsigned char footer_magic[2] = { 'Y', 'Z' };
+
+static int	read_fully(int, void *, size_t, off_t);
+static int	decode_vli(unsigned long long *, const unsigned char **, const unsigned char *);
+static unsigned	get_le32(const unsigned char *);
+
+/*
+ * Read the index of the xz stream that begins at offset start of the
+ * file referred to by fd and extends to the end of the file.  Return
+ * the index on success or NULL on failure.  On failure, errno is set
+ * to EINVAL if the file is not a suitable xz stream.  The index must
+ * be released with free() when no longer needed.
+ */
+extern struct xz_index *
+read_xz_index(int fd, off_t start)
+{
+	struct xz_index *xzi;
+	struct stat st;
+	unsigned long long nblock, unpadded, uncompressed;
+	size_t i, indexsize, outstart = 0;
+	off_t indexpos, offset;
+	unsigned char footer[XZ_FOOTER_SIZE], *index;
+	const unsigned char *ip, *iend;
+
+	xz_crc32_init();
+
+	if (fstat(fd, &st) == -1)
+		return (NULL);
+
+	if (st.st_size - start < XZ_HEADER_SIZE + XZ_FOOTER_SIZE)
+		goto invalid;
+
+	if (read_fully(fd, footer, sizeof footer, st.st_size - XZ_FOOTER_SIZE) != 0)
+		return (NULL);
+
+	if (memcmp(footer + 10, footer_magic, sizeof footer_magic) != 0
+	    || xz_crc32(footer + 4, 6, 0) != get_le32(footer))
+		goto invalid;
+
+	/* backward size is stored in multiples of four minus one */
+	indexsize = ((size_t)get_le32(footer + 4) + 1) * 4;
+	indexpos = st.st_size - XZ_FOOTER_SIZE - (off_t)indexsize;
+	if (indexpos < start + XZ_HEADER_SIZE)
+		goto invalid;
+
+	index = malloc(indexsize);
+	if (index == NULL)
+		return (NULL);
+
+	if (read_fully(fd, index, indexsize, indexpos) != 0)
+		goto fail;
+
+	if (xz_crc32(index, indexsize - 4, 0) != get_le32(index + indexsize - 4))
+		goto invalid_index;
+
+	ip = index;
+	iend = index + indexsize - 4;
+
+	/* index indicator and number of records */
+	if (*ip++ != 0x00 || decode_vli(&nblock, &ip, iend) != 0 || nblock == 0)
+		goto invalid_index;
+
+	/* each record takes at least two bytes */
+	if (nblock > indexsize / 2)
+		goto invalid_index;
+
+	xzi = malloc(sizeof *xzi + nblock * sizeof xzi->block[0]);
+	if (xzi == NULL)
+		goto fail;
+
+	if (read_fully(fd, xzi->header, sizeof xzi->header, start) != 0)
+		goto fail_xzi;
+
+	/* stream flags in header and footer must agree */
+	if (memcmp(xzi->header, header_magic, sizeof header_magic) != 0
+	    || memcmp(xzi->header + 6, footer + 8, 2) != 0
+	    || xz_crc32(xzi->header + 6, 2, 0) != get_le32(xzi->header + 8))
+		goto invalid_xzi;
+
+	xzi->nblock = nblock;
+	xzi->maxinsize = 0;
+	offset = start + XZ_HEADER_SIZE;
+
+	for (i = 0; i < nblock; i++) {
+		if (decode_vli(&unpadded, &ip, iend) != 0
+		    || decode_vli(&uncompressed, &ip, iend) != 0)
+			goto invalid_xzi;
+
+		xzi->block[i].offset = offset;
+		xzi->block[i].insize = (unpadded + 3) & ~3ULL;
+		xzi->block[i].outstart = outstart;
+		xzi->block[i].outsize = uncompressed;
+
+		offset += xzi->block[i].insize;
+		outstart += uncompressed;
+		if (xzi->block[i].insize > xzi->maxinsize)
+			xzi->maxinsize = xzi->block[i].insize;
+
+		/* all blocks must lie between stream header and index */
+		if (offset > indexpos)
+			goto invalid_xzi;
+	}
+
+	/* the rest is index padding */
+	while (ip < iend)
+		if (*ip++ != 0x00)
+			goto invalid_xzi;
+
+	if (offset != indexpos)
+		goto invalid_xzi;
+
+	xzi->outsize = outstart;
+	free(index);
+
+	return (xzi);
+
+invalid_xzi:
+	free(xzi);
+invalid_index:
+	free(index);
+invalid:
+	errno = EINVAL;
+	return (NULL);
+
+fail_xzi:
+	free(xzi);
+fail:
+	free(index);
+	return (NULL);
+}
+
+/*
+ * Decompress block i of the xz stream described by xzi from the file
+ * referred to by fd into out, which must have room for at least
+ * xzi->block[i].outsize bytes.  inbuf is a buffer of at least
+ * xzi->maxinsize bytes used to hold the compressed data.  xzd is a
+ * decoder allocated with a dictionary large enough for the stream.
+ * The block's integrity check is verified.  Return 0 on success, -1
+ * on failure with errno set.
+ */
+extern int
+decode_xz_block(struct xz_dec *xzd, int fd, const struct xz_index *xzi,
+    size_t i, unsigned char *out, unsigned char *inbuf)
+{
+	struct xz_buf xzb;
+	enum xz_ret error;
+
+	if (read_fully(fd, inbuf, xzi->block[i].insize, xzi->block[i].offset) != 0)
+		return (-1);
+
+	/*
+	 * xz-embedded can only decode whole streams.  We feed it a stream
+	 * header followed by the block and stop once the block has been
+	 * consumed entirely, at which point the decoder waits for the
+	 * next block.
+	 */
+	xz_dec_reset(xzd);
+
+	xzb.in = xzi->header;
+	xzb.in_pos = 0;
+	xzb.in_size = sizeof xzi->header;
+	xzb.out = out;
+	xzb.out_pos = 0;
+	xzb.out_size = xzi->block[i].outsize;
+
+	error = xz_dec_run(xzd, &xzb);
+	if (error != XZ_OK)
+		goto invalid;
+
+	xzb.in = inbuf;
+	xzb.in_pos = 0;
+	xzb.in_size = xzi->block[i].insize;
+
+	error = xz_dec_run(xzd, &xzb);
+	if (error == XZ_MEM_ERROR || error == XZ_MEMLIMIT_ERROR) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	if (error != XZ_OK || xzb.in_pos != xzb.in_size || xzb.out_pos != xzb.out_size)
+		goto invalid;
+
+	return (0);
+
+invalid:
+	errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * Return the index of the block containing uncompressed byte offset
+ * in xzi.  offset must be less than xzi->outsize.
+ */
+extern size_t
+find_xz_block(const struct xz_index *xzi, size_t offset)
+{
+	size_t lo = 0, hi = xzi->nblock, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (xzi->block[mid].outstart <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+/*
+ * Read exactly len bytes at offset from fd into buf.  Return 0 on
+ * success, -1 on failure.  A premature end of file is reported as EIO.
+ */
+static int
+read_fully(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		count = pread(fd, buf, len, offset);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return (-1);
+		}
+
+		if (count == 0) {
+			errno = EIO;
+			return (-1);
+		}
+
+		buf = (char*)buf + count;
+		len -= count;
+		offset += count;
+	}
+
+	return (0);
+}
+
+/*
+ * Decode an xz variable-length integer from *ip into *value, not
+ * reading past end.  Advance *ip past the integer.  Return 0 on
+ * success, -1 if the integer is malformed.
+ */
+static int
+decode_vli(unsigned long long *value, const unsigned char **ip, const unsigned char *end)
+{
+	const unsigned char *p = *ip;
+	size_t i;
+
+	*value = 0;
+	for (i = 0; i < XZ_VLI_MAX_BYTES && p < end; i++) {
+		*value |= (unsigned long long)(*p & 0x7f) << 7 * i;
+		if ((*p++ & 0x80) == 0) {
+			/* reject non-minimal encodings */
+			if (i > 0 && p[-1] == 0x00)
+				return (-1);
+
+			*ip = p;
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+/*
+ * Decode a little-endian 32 bit integer.
+ */
+static unsigned
+get_le32(const unsigned char *buf)
+{
+
+	return ((unsigned)buf[0] | (unsigned)buf[1] << 8
+	    | (unsigned)buf[2] << 16 | (unsigned)buf[3] << 24);
+}